@@ -34,22 +34,27 @@
 #include "config.h"
 
 #include <stddef.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <locale.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
-
-#if defined HAVE_XLOCALE_HEADER
-#include <xlocale.h>
-#endif
+#include <regex.h>
+#include <time.h>
 
 #if defined HAVE_POSIX_SPAWN || defined HAVE_POSIX_SPAWNP
 #include <spawn.h>
@@ -62,16 +67,92 @@ static char **environ;
 extern char **environ;
 #endif
 
-#define ENV_OUTPUT "INTERCEPT_BUILD_TARGET_DIR"
+#define ENV_OUTPUT    "INTERCEPT_BUILD_TARGET_DIR"
+#define ENV_TRANSPORT "INTERCEPT_BUILD_TRANSPORT"
+#define ENV_COMPILERS "INTERCEPT_BUILD_COMPILERS"
+#define ENV_CWD_CACHE "INTERCEPT_BUILD_CWD_CACHE"
+#define ENV_FORMAT    "INTERCEPT_BUILD_FORMAT"
+#define ENV_STATS     "INTERCEPT_BUILD_STATS"
+#define ENV_TIMELINE  "INTERCEPT_BUILD_TIMELINE"
+#define ENV_DRIVERS   "INTERCEPT_BUILD_DRIVERS"
+#define ENV_DRIVER    "INTERCEPT_BUILD_DRIVER"
 #ifdef APPLE
 # define ENV_FLAT    "DYLD_FORCE_FLAT_NAMESPACE"
 # define ENV_PRELOAD "DYLD_INSERT_LIBRARIES"
-# define ENV_SIZE 3
 #else
 # define ENV_PRELOAD "LD_PRELOAD"
-# define ENV_SIZE 2
 #endif
 
+/* Index of the captured variables. The mandatory ones are coming first,
+ * without those the library is not initialized. The optional ones are
+ * propagated to the child processes only if those were set. */
+enum {
+    ENV_OUTPUT_IDX,
+    ENV_PRELOAD_IDX,
+#ifdef ENV_FLAT
+    ENV_FLAT_IDX,
+#endif
+    ENV_MANDATORY_SIZE,
+    ENV_TRANSPORT_IDX = ENV_MANDATORY_SIZE,
+    ENV_COMPILERS_IDX,
+    ENV_CWD_CACHE_IDX,
+    ENV_FORMAT_IDX,
+    ENV_STATS_IDX,
+    ENV_TIMELINE_IDX,
+    ENV_DRIVERS_IDX,
+    ENV_DRIVER_IDX,
+    ENV_SIZE
+};
+
+/* The patched environment of the child processes is built on the stack,
+ * unless it has more entries than this. */
+#define ENV_PATCH_STACK_SIZE 512
+
+/* The captured variables are copied into a static storage, unless those
+ * are longer than this. */
+#define ENV_STORAGE_SIZE 4096
+
+/* The size of the report buffer. Reports written into their own file are
+ * flushed when it is full, otherwise the buffer grows on the heap. */
+#define REPORT_BUFFER_SIZE 4096
+
+#define TRACE_FILE_TEMPLATE "execution.XXXXXX"
+#define TRACE_LOG_FILE      "execution.log"
+#define TRACE_SOCKET_FILE   "intercept.sock"
+#define TRACE_DATAGRAM_MAX  65536
+#define TRACE_RING_FILE     "intercept.ring"
+#define TRACE_STATS_FILE    "stats.log"
+#define TRACE_TIMELINE_FILE "timeline.log"
+
+/* The number of buckets of the report duration histogram. The bucket of
+ * a report is the binary logarithm of its duration in nanoseconds, the
+ * last bucket takes the longer ones too. */
+#define STATS_BUCKETS       32
+
+/* The ring buffer file layout. It is created by the 'bear' program with
+ * a header page and the data area. The header has the magic number, the
+ * version, the capacity of the data area and two counters: 'head' is the
+ * end of the space reserved by the producers, 'tail' is the end of the
+ * space released by the consumer. Both counters are growing only, the
+ * position in the data area is the counter modulo the capacity.
+ *
+ * Each record starts with an 8 byte aligned word: the low half is the
+ * length of the payload, the high half is the commit stamp. A record is
+ * committed when the stamp matches the one computed from its position. */
+#define RING_MAGIC          0x62656172u
+#define RING_VERSION        1u
+#define RING_HEAD_OFFSET    64
+#define RING_TAIL_OFFSET    128
+#define RING_DATA_OFFSET    256
+#define RING_ALIGN          8
+
+/* The binary report layout. The header is followed by the working
+ * directory and the arguments, each terminated by a zero byte. The length
+ * is the size of those in bytes, the numbers are in native byte order.
+ * (The reports are read on the same machine.) */
+#define RECORD_TAG          "\0ear"
+#define RECORD_VERSION      1u
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define AT "libear: (" __FILE__ ":" TOSTRING(__LINE__) ") "
@@ -81,29 +162,168 @@ extern char **environ;
 #define ERROR_AND_EXIT(msg) do { PERROR(msg); exit(EXIT_FAILURE); } while (0)
 
 #define DLSYM(TYPE_, VAR_, SYMBOL_)                                 \
-    union {                                                         \
-        void *from;                                                 \
-        TYPE_ to;                                                   \
-    } cast;                                                         \
-    if (0 == (cast.from = dlsym(RTLD_NEXT, SYMBOL_))) {             \
-        PERROR("dlsym");                                            \
-        exit(EXIT_FAILURE);                                         \
-    }                                                               \
-    TYPE_ const VAR_ = cast.to;
+    do {                                                            \
+        union {                                                     \
+            void *from;                                             \
+            TYPE_ to;                                               \
+        } cast;                                                     \
+        cast.from = dlsym(RTLD_NEXT, SYMBOL_);                      \
+        VAR_ = cast.to;                                             \
+    } while (0)
+
+#ifdef HAVE_ATOMIC_BUILTINS
+# define STATS_ADD(VAR_, VALUE_) __atomic_fetch_add(&(VAR_), (VALUE_), __ATOMIC_RELAXED)
+# define STATS_TAKE(VAR_)        __atomic_exchange_n(&(VAR_), 0, __ATOMIC_RELAXED)
+#else
+/* Without atomic operations concurrent threads might lose updates, but
+ * these are only statistics. */
+# define STATS_ADD(VAR_, VALUE_) ((VAR_) += (VALUE_))
+# define STATS_TAKE(VAR_)        stats_take(&(VAR_))
+#endif
+
+#define REAL_OR_FAIL(VAR_, FAILURE_)                                \
+    do {                                                            \
+        pthread_once(&real_once, resolve_real_methods);             \
+        if (0 == (VAR_)) {                                          \
+            errno = ENOSYS;                                         \
+            PERROR("dlsym");                                        \
+            return (FAILURE_);                                      \
+        }                                                           \
+    } while (0)
 
 
 typedef char const * bear_env_t[ENV_SIZE];
 
-static int capture_env_t(bear_env_t *env);
+/* The transport decides how the execution reports are delivered. */
+typedef enum {
+    TRANSPORT_FILES,    // one new file per report
+    TRANSPORT_LOG,      // one shared append-only file for all reports
+    TRANSPORT_SOCKET,   // one datagram per report, files as fallback
+    TRANSPORT_RING      // shared memory ring buffer, files as fallback
+} transport_t;
+
+/* The intercepted entry points, the statistics are counted by these. */
+typedef enum {
+    ENTRY_EXECVE,
+    ENTRY_EXECV,
+    ENTRY_EXECVPE,
+    ENTRY_EXECVP,
+    ENTRY_EXECVP2,
+    ENTRY_EXECT,
+    ENTRY_EXECL,
+    ENTRY_EXECLP,
+    ENTRY_EXECLE,
+    ENTRY_POSIX_SPAWN,
+    ENTRY_POSIX_SPAWNP,
+    ENTRY_SIZE
+} entry_t;
+
+/* The self instrumentation counters of the process. These are written into
+ * the statistics file (and reset) before the process image is replaced,
+ * and when the library is unloaded. */
+typedef struct {
+    uint64_t calls[ENTRY_SIZE];
+    uint64_t reports;
+    uint64_t report_ns;
+    uint64_t histogram[STATS_BUCKETS];
+    uint64_t bytes;
+    uint64_t env_patches;
+    uint64_t env_allocations;
+} stats_t;
+
+/* The format of the execution reports. */
+typedef enum {
+    FORMAT_JSON,        // one line JSON object
+    FORMAT_BINARY       // length prefixed record, strings written verbatim
+} format_t;
+
+typedef struct {
+    char tag[4];
+    uint32_t version;
+    uint32_t length;
+    int32_t pid;
+    uint32_t argc;
+} record_header_t;
+
+/* The mapped ring buffer file of the current process. */
+typedef struct {
+    unsigned char *base;
+    size_t size;
+    uint64_t capacity;
+} ring_t;
+
+/* Memory area the reports are formatted into. When it has a file
+ * descriptor, it is flushed into that when full. Otherwise it grows on
+ * the heap to keep the whole report in one piece. */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t written;
+    int fd;
+    char storage[REPORT_BUFFER_SIZE];
+} buffer_t;
+
+/* The working directory of the process, encoded as it goes into the report.
+ * It's marked stale by the 'chdir' and 'fchdir' calls, and checked against
+ * the device and inode of the current directory (and of the directory the
+ * path names) before it's used. */
+typedef struct {
+    char *path;
+    char *encoded;
+    size_t size;
+    dev_t device;
+    ino_t inode;
+    int valid;
+} cwd_cache_t;
+
+static int capture_env_t(bear_env_t *env, bear_env_t *entries);
 static void release_env_t(bear_env_t *env);
-static char const **string_array_partial_update(char *const envp[], bear_env_t *env);
-static char const **string_array_single_update(char const **in, char const *key, char const *value);
-static void report_call(char const *const argv[]);
-static void write_report(int fd, char const *const argv[]);
-static int write_json_report(int fd, char const *const cmd[], char const *cwd, pid_t pid);
-static int encode_json_string(char const *src, char *dst, size_t dst_size);
+static transport_t parse_transport(char const *value);
+static format_t parse_format(char const *value);
+static int is_reported(char const *const argv[]);
+static int is_driver(char const *const argv[]);
+static int program_matches(regex_t const *filter, char const *const argv[]);
+static size_t env_entry_index(char const *entry);
+static char const **env_patch(char *const argv[], char *const envp[], char const **storage, size_t storage_size);
+static void env_patch_release(char const **patched, char *const envp[], char const **storage);
+static void report_call(entry_t entry, char const *const argv[]);
+static size_t send_report(char const *const argv[]);
+static int send_trace_datagram(char const *out_dir, buffer_t const *buffer);
+static void write_trace_file(char const *out_dir, transport_t mode, buffer_t const *buffer);
+static int send_trace_ring(char const *out_dir, buffer_t const *buffer);
+static int map_trace_ring(char const *out_dir, ring_t *ring);
+static void unmap_trace_ring(ring_t *ring);
+static int open_trace_file(char const *out_dir, transport_t mode);
+static void write_report(buffer_t *buffer, char const *const argv[]);
+static void write_formatted_report(buffer_t *buffer, char const *const cmd[], char const *cwd, size_t cwd_size, pid_t pid);
+static void write_json_report(buffer_t *buffer, char const *const cmd[], char const *cwd, size_t cwd_size, pid_t pid);
+static void write_binary_report(buffer_t *buffer, char const *const cmd[], char const *cwd, size_t cwd_size, pid_t pid);
+static void encode_cwd(char const *cwd, buffer_t *buffer);
+static int cwd_cache_check(cwd_cache_t const *cache);
+static int cwd_cache_update(cwd_cache_t *cache);
+static void cwd_cache_drop(void);
+static void cwd_cache_release(cwd_cache_t *cache);
+static uint64_t monotonic_ns(void);
+static void stats_count_call(entry_t entry, uint64_t duration, size_t bytes);
+static void stats_append(buffer_t *buffer, char const *fmt, char const *name, uint64_t value);
+static void stats_flush(void);
+static void stats_reset(void);
+static void timeline_start(pid_t pid, pid_t ppid, char const *const argv[], uint64_t time);
+static void timeline_exit(pid_t pid, int status, struct rusage const *usage);
+static void append_trace_log(char const *name, buffer_t const *buffer);
+static void append_trace_file(char const *path, char const *data, size_t size);
+static size_t format_decimal(char *dst, uint64_t value);
+#ifndef HAVE_ATOMIC_BUILTINS
+static uint64_t stats_take(uint64_t *value);
+#endif
+static void encode_json_string(char const *src, buffer_t *buffer);
+static size_t utf8_sequence_length(unsigned char const *it);
+static void buffer_init(buffer_t *buffer, int fd);
+static void buffer_append(buffer_t *buffer, char const *data, size_t size);
+static void buffer_flush(buffer_t *buffer);
+static void buffer_release(buffer_t *buffer);
 static char const **string_array_from_varargs(char const *arg, va_list *ap);
-static char const **string_array_copy(char const **const in);
 static size_t string_array_length(char const *const *in);
 static void string_array_release(char const **);
 
@@ -114,6 +334,14 @@ static bear_env_t env_names =
 #ifdef ENV_FLAT
     , ENV_FLAT
 #endif
+    , ENV_TRANSPORT
+    , ENV_COMPILERS
+    , ENV_CWD_CACHE
+    , ENV_FORMAT
+    , ENV_STATS
+    , ENV_TIMELINE
+    , ENV_DRIVERS
+    , ENV_DRIVER
     };
 
 static bear_env_t initial_env =
@@ -122,16 +350,158 @@ static bear_env_t initial_env =
 #ifdef ENV_FLAT
     , 0
 #endif
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    };
+
+/* The captured variables in "name=value" form, ready to put into the
+ * environment of the child processes. */
+static bear_env_t initial_entries =
+    { 0
+    , 0
+#ifdef ENV_FLAT
+    , 0
+#endif
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    , 0
+    };
+
+/* The storage of the captured variables. The initial environment block is
+ * not referenced, because the process might rewrite it (like the
+ * 'setproctitle' implementations do). */
+static char env_storage[ENV_STORAGE_SIZE];
+static char *env_storage_heap = 0;
+
+static transport_t transport = TRANSPORT_FILES;
+static format_t format = FORMAT_JSON;
+static ring_t ring = { 0, 0, 0 };
+
+/* When the compiler filter is given, only the matching calls are reported. */
+static regex_t compiler_filter;
+static int compiler_filter_enabled = 0;
+
+/* The children of the compiler drivers (like 'cc1', 'as' or the compiler
+ * behind 'ccache') are not reported. The driver processes get a marker in
+ * their environment, which is inherited by the whole process tree of the
+ * driver. */
+static regex_t driver_filter;
+static int driver_filter_enabled = 0;
+static int driver_child = 0;
+static char const driver_entry[] = ENV_DRIVER "=1";
+
+/* When the cache is enabled, the working directory is queried only after
+ * it might have changed. */
+static cwd_cache_t cwd_cache = { 0, 0, 0, 0, 0, 0 };
+static int cwd_cache_enabled = 0;
+static pthread_mutex_t cwd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The statistics are counted only when those were asked for. */
+static stats_t stats;
+static int stats_enabled = 0;
+
+/* The start and the end of the processes are written into the timeline
+ * file only when it was asked for. (The request is taken when the library
+ * is loaded, because the wait calls do not initialize the library.) */
+static int timeline_enabled = 0;
+static int timeline_requested = 0;
+static char timeline_file[PATH_MAX];
+
+static char const *const entry_names[ENTRY_SIZE] =
+    { "execve"
+    , "execv"
+    , "execvpe"
+    , "execvp"
+    , "execvP"
+    , "exect"
+    , "execl"
+    , "execlp"
+    , "execle"
+    , "posix_spawn"
+    , "posix_spawnp"
     };
 
+/* The real implementations of the intercepted methods. These are resolved
+ * once, at the first intercepted call. (Except 'wait4' for the timeline,
+ * which is resolved when the library is loaded.) A missing symbol is a null
+ * pointer, and the call fails with ENOSYS. */
+typedef int (*execve_t)(const char *, char *const *, char *const *);
+typedef int (*execvp_t)(const char *, char *const *);
+typedef int (*execvP_t)(const char *, const char *, char *const *);
+typedef int (*chdir_t)(const char *);
+typedef int (*fchdir_t)(int);
+typedef pid_t (*wait4_t)(pid_t, int *, int, struct rusage *);
+#if defined HAVE_POSIX_SPAWN || defined HAVE_POSIX_SPAWNP
+typedef int (*posix_spawn_t)(pid_t *restrict, const char *restrict,
+                             const posix_spawn_file_actions_t *,
+                             const posix_spawnattr_t *restrict,
+                             char *const *restrict, char *const *restrict);
+#endif
+
+static struct {
+#ifdef HAVE_EXECVE
+    execve_t execve;
+#endif
+#ifdef HAVE_EXECVPE
+    execve_t execvpe;
+#endif
+#ifdef HAVE_EXECVP
+    execvp_t execvp;
+#endif
+#ifdef HAVE_EXECVP2
+    execvP_t execvP;
+#endif
+#ifdef HAVE_EXECT
+    execve_t exect;
+#endif
+#ifdef HAVE_POSIX_SPAWN
+    posix_spawn_t posix_spawn;
+#endif
+#ifdef HAVE_POSIX_SPAWNP
+    posix_spawn_t posix_spawnp;
+#endif
+#ifdef HAVE_CHDIR
+    chdir_t chdir;
+#endif
+#ifdef HAVE_FCHDIR
+    fchdir_t fchdir;
+#endif
+#ifdef HAVE_WAIT4
+    wait4_t wait4;
+#endif
+    int unused;
+} real;
+
+static pthread_once_t real_once = PTHREAD_ONCE_INIT;
+
+static void resolve_real_methods(void);
+
+/* The library is set up at the first intercepted call, most of the build
+ * processes (compilers, linkers) are not calling any of those. Only the
+ * relevant environment variables are captured when it's loaded. */
+static int captured = 0;
 static int initialized = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static locale_t utf_locale;
 
 static void on_load(void) __attribute__((constructor));
 static void on_unload(void) __attribute__((destructor));
+static void on_first_call(void);
+static void on_fork_child(void);
+static int ensure_initialized(void);
 
-static int mt_safe_on_load(void);
+static int mt_safe_on_first_call(void);
 static void mt_safe_on_unload(void);
 
 
@@ -168,18 +538,67 @@ static int call_posix_spawnp(pid_t *restrict pid, const char *restrict file,
                              char *const argv[restrict],
                              char *const envp[restrict]);
 #endif
+#ifdef HAVE_CHDIR
+static int call_chdir(const char *path);
+#endif
+#ifdef HAVE_FCHDIR
+static int call_fchdir(int fd);
+#endif
+#ifdef HAVE_WAIT4
+static pid_t call_wait4(pid_t pid, int *status, int options,
+                        struct rusage *usage);
+#endif
 
 
 /* Initialization method to Captures the relevant environment variables.
+ * (The environment of the process might be changed before the first
+ * intercepted call, but the child processes shall get the initial values.)
  */
 
 static void on_load(void) {
+#ifdef HAVE_NSGETENVIRON
+    environ = *_NSGetEnviron();
+    if (0 == environ)
+        return;
+#endif
+    captured = capture_env_t(&initial_env, &initial_entries);
+    timeline_requested = (captured) && (initial_env[ENV_TIMELINE_IDX]) &&
+        (0 != strcmp(initial_env[ENV_TIMELINE_IDX], "0"));
+    // The exit events might be written from a signal handler, so the path
+    // is not built there.
+    if (timeline_requested) {
+        int const length = snprintf(timeline_file, sizeof(timeline_file), "%s/%s",
+                                    initial_env[ENV_OUTPUT_IDX], TRACE_TIMELINE_FILE);
+        timeline_requested = (0 < length) && ((size_t)length < sizeof(timeline_file));
+    }
+#ifdef HAVE_WAIT4
+    // The wait calls might come from a signal handler, where the lazy
+    // resolution (and the initialization) might deadlock. Those are
+    // doing more than forwarding the call only for the timeline.
+    if (timeline_requested)
+        DLSYM(wait4_t, real.wait4, "wait4");
+#endif
+}
+
+static void on_first_call(void) {
     pthread_mutex_lock(&mutex);
-    if ((!initialized) && (mt_safe_on_load()))
+    if ((!initialized) && (captured) && (mt_safe_on_first_call()))
         initialized = 1;
     pthread_mutex_unlock(&mutex);
 }
 
+static int ensure_initialized(void) {
+    pthread_once(&init_once, on_first_call);
+    return initialized;
+}
+
+/* The forked child has only the forking thread, the locks which were held
+ * by the other threads of the parent would be never released. */
+static void on_fork_child(void) {
+    pthread_mutex_init(&mutex, 0);
+    pthread_mutex_init(&cwd_mutex, 0);
+}
+
 static void on_unload(void) {
     pthread_mutex_lock(&mutex);
     if (initialized)
@@ -188,28 +607,59 @@ static void on_unload(void) {
     pthread_mutex_unlock(&mutex);
 }
 
-static int mt_safe_on_load(void) {
-#ifdef HAVE_NSGETENVIRON
-    environ = *_NSGetEnviron();
-    if (0 == environ)
-        return 0;
-#endif
-    // Create locale to encode UTF-8 characters
-    utf_locale = newlocale(LC_CTYPE_MASK, "", (locale_t)0);
-    if ((locale_t)0 == utf_locale) {
-        PERROR("newlocale");
-        return 0;
+static int mt_safe_on_first_call(void) {
+    pthread_atfork(0, 0, on_fork_child);
+    transport = parse_transport(initial_env[ENV_TRANSPORT_IDX]);
+    format = parse_format(initial_env[ENV_FORMAT_IDX]);
+    // Compile the filter once, without it every call is reported.
+    if (initial_env[ENV_COMPILERS_IDX]) {
+        compiler_filter_enabled =
+            (0 == regcomp(&compiler_filter, initial_env[ENV_COMPILERS_IDX], REG_EXTENDED | REG_NOSUB));
+        if (!compiler_filter_enabled)
+            fprintf(stderr, AT "regcomp: invalid compiler filter, report all calls\n");
     }
-    // Capture current relevant environment variables
-    if (0 == capture_env_t(&initial_env))
-        return 0;
+    driver_child =
+        (initial_env[ENV_DRIVER_IDX]) && (0 != strcmp(initial_env[ENV_DRIVER_IDX], "0"));
+    // Inside a driver process tree every process is a child of a driver.
+    if ((!driver_child) && (initial_env[ENV_DRIVERS_IDX])) {
+        driver_filter_enabled =
+            (0 == regcomp(&driver_filter, initial_env[ENV_DRIVERS_IDX], REG_EXTENDED | REG_NOSUB));
+        if (!driver_filter_enabled)
+            fprintf(stderr, AT "regcomp: invalid driver filter, report all calls\n");
+    }
+    cwd_cache_enabled =
+        (initial_env[ENV_CWD_CACHE_IDX]) && (0 != strcmp(initial_env[ENV_CWD_CACHE_IDX], "0"));
+    stats_enabled =
+        (initial_env[ENV_STATS_IDX]) && (0 != strcmp(initial_env[ENV_STATS_IDX], "0"));
+    // The counters are not inherited by the forked children.
+    if (stats_enabled)
+        pthread_atfork(0, 0, stats_reset);
+    timeline_enabled = timeline_requested;
     // Well done
     return 1;
 }
 
 static void mt_safe_on_unload(void) {
-    freelocale(utf_locale);
+    stats_flush();
+    stats_enabled = 0;
+    timeline_enabled = 0;
+    timeline_requested = 0;
+    if (compiler_filter_enabled)
+        regfree(&compiler_filter);
+    compiler_filter_enabled = 0;
+    if (driver_filter_enabled)
+        regfree(&driver_filter);
+    driver_filter_enabled = 0;
+    driver_child = 0;
+    pthread_mutex_lock(&cwd_mutex);
+    cwd_cache_release(&cwd_cache);
+    cwd_cache_enabled = 0;
+    pthread_mutex_unlock(&cwd_mutex);
+    unmap_trace_ring(&ring);
     release_env_t(&initial_env);
+    release_env_t(&initial_entries);
+    free(env_storage_heap);
+    env_storage_heap = 0;
 }
 
 
@@ -218,7 +668,7 @@ static void mt_safe_on_unload(void) {
 
 #ifdef HAVE_EXECVE
 int execve(const char *path, char *const argv[], char *const envp[]) {
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECVE, (char const *const *)argv);
     return call_execve(path, argv, envp);
 }
 #endif
@@ -228,35 +678,35 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
 #error can not implement execv without execve
 #endif
 int execv(const char *path, char *const argv[]) {
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECV, (char const *const *)argv);
     return call_execve(path, argv, environ);
 }
 #endif
 
 #ifdef HAVE_EXECVPE
 int execvpe(const char *file, char *const argv[], char *const envp[]) {
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECVPE, (char const *const *)argv);
     return call_execvpe(file, argv, envp);
 }
 #endif
 
 #ifdef HAVE_EXECVP
 int execvp(const char *file, char *const argv[]) {
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECVP, (char const *const *)argv);
     return call_execvp(file, argv);
 }
 #endif
 
 #ifdef HAVE_EXECVP2
 int execvP(const char *file, const char *search_path, char *const argv[]) {
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECVP2, (char const *const *)argv);
     return call_execvP(file, search_path, argv);
 }
 #endif
 
 #ifdef HAVE_EXECT
 int exect(const char *path, char *const argv[], char *const envp[]) {
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECT, (char const *const *)argv);
     return call_exect(path, argv, envp);
 }
 #endif
@@ -271,7 +721,7 @@ int execl(const char *path, const char *arg, ...) {
     char const **argv = string_array_from_varargs(arg, &args);
     va_end(args);
 
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECL, (char const *const *)argv);
     int const result = call_execve(path, (char *const *)argv, environ);
 
     string_array_release(argv);
@@ -289,7 +739,7 @@ int execlp(const char *file, const char *arg, ...) {
     char const **argv = string_array_from_varargs(arg, &args);
     va_end(args);
 
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECLP, (char const *const *)argv);
     int const result = call_execvp(file, (char *const *)argv);
 
     string_array_release(argv);
@@ -309,7 +759,7 @@ int execle(const char *path, const char *arg, ...) {
     char const **envp = va_arg(args, char const **);
     va_end(args);
 
-    report_call((char const *const *)argv);
+    report_call(ENTRY_EXECLE, (char const *const *)argv);
     int const result =
         call_execve(path, (char *const *)argv, (char *const *)envp);
 
@@ -323,8 +773,12 @@ int posix_spawn(pid_t *restrict pid, const char *restrict path,
                 const posix_spawn_file_actions_t *file_actions,
                 const posix_spawnattr_t *restrict attrp,
                 char *const argv[restrict], char *const envp[restrict]) {
-    report_call((char const *const *)argv);
-    return call_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+    report_call(ENTRY_POSIX_SPAWN, (char const *const *)argv);
+    uint64_t const start = (timeline_enabled) ? monotonic_ns() : 0;
+    int const result = call_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+    if ((timeline_enabled) && (0 == result) && (pid))
+        timeline_start(*pid, getpid(), (char const *const *)argv, start);
+    return result;
 }
 #endif
 
@@ -333,24 +787,113 @@ int posix_spawnp(pid_t *restrict pid, const char *restrict file,
                  const posix_spawn_file_actions_t *file_actions,
                  const posix_spawnattr_t *restrict attrp,
                  char *const argv[restrict], char *const envp[restrict]) {
-    report_call((char const *const *)argv);
-    return call_posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+    report_call(ENTRY_POSIX_SPAWNP, (char const *const *)argv);
+    uint64_t const start = (timeline_enabled) ? monotonic_ns() : 0;
+    int const result = call_posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+    if ((timeline_enabled) && (0 == result) && (pid))
+        timeline_start(*pid, getpid(), (char const *const *)argv, start);
+    return result;
+}
+#endif
+
+/* These are tracked to know when the working directory has changed.
+ */
+
+#ifdef HAVE_CHDIR
+int chdir(const char *path) {
+    int const result = call_chdir(path);
+    int const saved_errno = errno;
+    cwd_cache_drop();
+    errno = saved_errno;
+    return result;
+}
+#endif
+
+#ifdef HAVE_FCHDIR
+int fchdir(int fd) {
+    int const result = call_fchdir(fd);
+    int const saved_errno = errno;
+    cwd_cache_drop();
+    errno = saved_errno;
+    return result;
+}
+#endif
+
+/* These are tracked to know when the child processes have finished. All
+ * of them are forwarded to 'wait4', which tells the resource usage too.
+ */
+
+#ifdef HAVE_WAIT4
+# ifdef HAVE_WAIT
+pid_t wait(int *status) {
+    return call_wait4(-1, status, 0, 0);
+}
+# endif
+
+# ifdef HAVE_WAITPID
+pid_t waitpid(pid_t pid, int *status, int options) {
+    return call_wait4(pid, status, options, 0);
+}
+# endif
+
+# ifdef HAVE_WAIT3
+pid_t wait3(int *status, int options, struct rusage *usage) {
+    return call_wait4(-1, status, options, usage);
+}
+# endif
+
+pid_t wait4(pid_t pid, int *status, int options, struct rusage *usage) {
+    return call_wait4(pid, status, options, usage);
 }
 #endif
 
 /* These are the methods which forward the call to the standard implementation.
  */
 
+static void resolve_real_methods(void) {
+#ifdef HAVE_EXECVE
+    DLSYM(execve_t, real.execve, "execve");
+#endif
+#ifdef HAVE_EXECVPE
+    DLSYM(execve_t, real.execvpe, "execvpe");
+#endif
+#ifdef HAVE_EXECVP
+    DLSYM(execvp_t, real.execvp, "execvp");
+#endif
+#ifdef HAVE_EXECVP2
+    DLSYM(execvP_t, real.execvP, "execvP");
+#endif
+#ifdef HAVE_EXECT
+    DLSYM(execve_t, real.exect, "exect");
+#endif
+#ifdef HAVE_POSIX_SPAWN
+    DLSYM(posix_spawn_t, real.posix_spawn, "posix_spawn");
+#endif
+#ifdef HAVE_POSIX_SPAWNP
+    DLSYM(posix_spawn_t, real.posix_spawnp, "posix_spawnp");
+#endif
+#ifdef HAVE_CHDIR
+    DLSYM(chdir_t, real.chdir, "chdir");
+#endif
+#ifdef HAVE_FCHDIR
+    DLSYM(fchdir_t, real.fchdir, "fchdir");
+#endif
+#ifdef HAVE_WAIT4
+    if (0 == real.wait4)
+        DLSYM(wait4_t, real.wait4, "wait4");
+#endif
+}
+
 #ifdef HAVE_EXECVE
 static int call_execve(const char *path, char *const argv[],
                        char *const envp[]) {
-    typedef int (*func)(const char *, char *const *, char *const *);
-
-    DLSYM(func, fp, "execve");
+    REAL_OR_FAIL(real.execve, -1);
 
-    char const **const menvp = string_array_partial_update(envp, &initial_env);
-    int const result = (*fp)(path, argv, (char *const *)menvp);
-    string_array_release(menvp);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const menvp = env_patch(argv, envp, storage, ENV_PATCH_STACK_SIZE);
+    stats_flush();
+    int const result = (*real.execve)(path, argv, (char *const *)menvp);
+    env_patch_release(menvp, envp, storage);
     return result;
 }
 #endif
@@ -358,29 +901,29 @@ static int call_execve(const char *path, char *const argv[],
 #ifdef HAVE_EXECVPE
 static int call_execvpe(const char *file, char *const argv[],
                         char *const envp[]) {
-    typedef int (*func)(const char *, char *const *, char *const *);
+    REAL_OR_FAIL(real.execvpe, -1);
 
-    DLSYM(func, fp, "execvpe");
-
-    char const **const menvp = string_array_partial_update(envp, &initial_env);
-    int const result = (*fp)(file, argv, (char *const *)menvp);
-    string_array_release(menvp);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const menvp = env_patch(argv, envp, storage, ENV_PATCH_STACK_SIZE);
+    stats_flush();
+    int const result = (*real.execvpe)(file, argv, (char *const *)menvp);
+    env_patch_release(menvp, envp, storage);
     return result;
 }
 #endif
 
 #ifdef HAVE_EXECVP
 static int call_execvp(const char *file, char *const argv[]) {
-    typedef int (*func)(const char *file, char *const argv[]);
-
-    DLSYM(func, fp, "execvp");
+    REAL_OR_FAIL(real.execvp, -1);
 
     char **const original = environ;
-    char const **const modified = string_array_partial_update(original, &initial_env);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const modified = env_patch(argv, original, storage, ENV_PATCH_STACK_SIZE);
     environ = (char **)modified;
-    int const result = (*fp)(file, argv);
+    stats_flush();
+    int const result = (*real.execvp)(file, argv);
     environ = original;
-    string_array_release(modified);
+    env_patch_release(modified, original, storage);
 
     return result;
 }
@@ -389,16 +932,16 @@ static int call_execvp(const char *file, char *const argv[]) {
 #ifdef HAVE_EXECVP2
 static int call_execvP(const char *file, const char *search_path,
                        char *const argv[]) {
-    typedef int (*func)(const char *, const char *, char *const *);
-
-    DLSYM(func, fp, "execvP");
+    REAL_OR_FAIL(real.execvP, -1);
 
     char **const original = environ;
-    char const **const modified = string_array_partial_update(original, &initial_env);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const modified = env_patch(argv, original, storage, ENV_PATCH_STACK_SIZE);
     environ = (char **)modified;
-    int const result = (*fp)(file, search_path, argv);
+    stats_flush();
+    int const result = (*real.execvP)(file, search_path, argv);
     environ = original;
-    string_array_release(modified);
+    env_patch_release(modified, original, storage);
 
     return result;
 }
@@ -407,13 +950,13 @@ static int call_execvP(const char *file, const char *search_path,
 #ifdef HAVE_EXECT
 static int call_exect(const char *path, char *const argv[],
                       char *const envp[]) {
-    typedef int (*func)(const char *, char *const *, char *const *);
+    REAL_OR_FAIL(real.exect, -1);
 
-    DLSYM(func, fp, "exect");
-
-    char const **const menvp = string_array_partial_update(envp, &initial_env);
-    int const result = (*fp)(path, argv, (char *const *)menvp);
-    string_array_release(menvp);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const menvp = env_patch(argv, envp, storage, ENV_PATCH_STACK_SIZE);
+    stats_flush();
+    int const result = (*real.exect)(path, argv, (char *const *)menvp);
+    env_patch_release(menvp, envp, storage);
     return result;
 }
 #endif
@@ -424,17 +967,13 @@ static int call_posix_spawn(pid_t *restrict pid, const char *restrict path,
                             const posix_spawnattr_t *restrict attrp,
                             char *const argv[restrict],
                             char *const envp[restrict]) {
-    typedef int (*func)(pid_t *restrict, const char *restrict,
-                        const posix_spawn_file_actions_t *,
-                        const posix_spawnattr_t *restrict,
-                        char *const *restrict, char *const *restrict);
-
-    DLSYM(func, fp, "posix_spawn");
+    REAL_OR_FAIL(real.posix_spawn, ENOSYS);
 
-    char const **const menvp = string_array_partial_update(envp, &initial_env);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const menvp = env_patch(argv, envp, storage, ENV_PATCH_STACK_SIZE);
     int const result =
-        (*fp)(pid, path, file_actions, attrp, argv, (char *const *restrict)menvp);
-    string_array_release(menvp);
+        (*real.posix_spawn)(pid, path, file_actions, attrp, argv, (char *const *restrict)menvp);
+    env_patch_release(menvp, envp, storage);
     return result;
 }
 #endif
@@ -445,202 +984,929 @@ static int call_posix_spawnp(pid_t *restrict pid, const char *restrict file,
                              const posix_spawnattr_t *restrict attrp,
                              char *const argv[restrict],
                              char *const envp[restrict]) {
-    typedef int (*func)(pid_t *restrict, const char *restrict,
-                        const posix_spawn_file_actions_t *,
-                        const posix_spawnattr_t *restrict,
-                        char *const *restrict, char *const *restrict);
-
-    DLSYM(func, fp, "posix_spawnp");
+    REAL_OR_FAIL(real.posix_spawnp, ENOSYS);
 
-    char const **const menvp = string_array_partial_update(envp, &initial_env);
+    char const *storage[ENV_PATCH_STACK_SIZE];
+    char const **const menvp = env_patch(argv, envp, storage, ENV_PATCH_STACK_SIZE);
     int const result =
-        (*fp)(pid, file, file_actions, attrp, argv, (char *const *restrict)menvp);
-    string_array_release(menvp);
+        (*real.posix_spawnp)(pid, file, file_actions, attrp, argv, (char *const *restrict)menvp);
+    env_patch_release(menvp, envp, storage);
+    return result;
+}
+#endif
+
+#ifdef HAVE_CHDIR
+static int call_chdir(const char *path) {
+    REAL_OR_FAIL(real.chdir, -1);
+
+    return (*real.chdir)(path);
+}
+#endif
+
+#ifdef HAVE_FCHDIR
+static int call_fchdir(int fd) {
+    REAL_OR_FAIL(real.fchdir, -1);
+
+    return (*real.fchdir)(fd);
+}
+#endif
+
+#ifdef HAVE_WAIT4
+/* It might be called from a signal handler (like the SIGCHLD handler of a
+ * shell), therefore it does not initialize the library. The timeline is
+ * written only when the captured environment asks for it, the real method
+ * is resolved at load then. */
+static pid_t call_wait4(pid_t pid, int *status, int options,
+                        struct rusage *usage) {
+    if (!timeline_requested) {
+        REAL_OR_FAIL(real.wait4, -1);
+        return (*real.wait4)(pid, status, options, usage);
+    }
+    if (0 == real.wait4) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // The caller might not be interested in these, but the timeline is.
+    int local_status = 0;
+    struct rusage local_usage;
+    int *const status_ptr = (status) ? status : &local_status;
+    struct rusage *const usage_ptr = (usage) ? usage : &local_usage;
+    pid_t const result = (*real.wait4)(pid, status_ptr, options, usage_ptr);
+    if ((0 < result) && (WIFEXITED(*status_ptr) || WIFSIGNALED(*status_ptr))) {
+        int const saved_errno = errno;
+        timeline_exit(result, *status_ptr, usage_ptr);
+        errno = saved_errno;
+    }
     return result;
 }
 #endif
 
 /* this method is to write log about the process creation. */
 
-static void report_call(char const *const argv[]) {
-    if (!initialized)
+static void report_call(entry_t const entry, char const *const argv[]) {
+    if (!ensure_initialized())
         return;
-    // Create report file name
-    char const * const out_dir = initial_env[0];
+    uint64_t const start = (stats_enabled || timeline_enabled) ? monotonic_ns() : 0;
+    size_t const bytes = (is_reported(argv)) ? send_report(argv) : 0;
+    if (stats_enabled)
+        stats_count_call(entry, monotonic_ns() - start, bytes);
+    // The process image is replaced in this process, but the spawned
+    // process pid is known only after the call.
+    if ((timeline_enabled) && (ENTRY_POSIX_SPAWN != entry) && (ENTRY_POSIX_SPAWNP != entry))
+        timeline_start(getpid(), getppid(), argv, start);
+}
+
+/* Returns the size of the report. */
+static size_t send_report(char const *const argv[]) {
+    char const *const out_dir = initial_env[ENV_OUTPUT_IDX];
+    buffer_t buffer;
+    // Stream the report into its own file.
+    if (TRANSPORT_FILES == transport) {
+        int fd = open_trace_file(out_dir, transport);
+        if (-1 == fd)
+            ERROR_AND_EXIT("open");
+        buffer_init(&buffer, fd);
+        write_report(&buffer, argv);
+        buffer_flush(&buffer);
+        if (close(fd))
+            ERROR_AND_EXIT("close");
+        return buffer.written;
+    }
+    // Format the report in memory first, so it can be written at once
+    buffer_init(&buffer, -1);
+    write_report(&buffer, argv);
+    // Send the report to the collector, when it's not reachable fall back
+    // to write it into the target directory.
+    if (TRANSPORT_SOCKET == transport) {
+        if (0 != send_trace_datagram(out_dir, &buffer))
+            write_trace_file(out_dir, TRANSPORT_FILES, &buffer);
+    } else if (TRANSPORT_RING == transport) {
+        if (0 != send_trace_ring(out_dir, &buffer))
+            write_trace_file(out_dir, TRANSPORT_FILES, &buffer);
+    } else {
+        write_trace_file(out_dir, transport, &buffer);
+    }
+    size_t const size = buffer.size;
+    buffer_release(&buffer);
+    return size;
+}
+
+/* Check the program name against the compiler filter. The children of the
+ * compiler drivers are not reported. */
+static int is_reported(char const *const argv[]) {
+    if (driver_child)
+        return 0;
+    if (!compiler_filter_enabled)
+        return 1;
+    return program_matches(&compiler_filter, argv);
+}
+
+/* Check the program name against the driver filter. */
+static int is_driver(char const *const argv[]) {
+    if (!driver_filter_enabled)
+        return 0;
+    return program_matches(&driver_filter, argv);
+}
+
+static int program_matches(regex_t const *const filter, char const *const argv[]) {
+    if ((0 == argv) || (0 == argv[0]))
+        return 0;
+    char const *const separator = strrchr(argv[0], '/');
+    char const *const program = (separator) ? separator + 1 : argv[0];
+    return (0 == regexec(filter, program, 0, 0, 0)) ? 1 : 0;
+}
+
+static int send_trace_datagram(char const *const out_dir, buffer_t const *const buffer) {
+    if (buffer->size > TRACE_DATAGRAM_MAX)
+        return -1;
+    // Create the collector address
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    int const path_length = snprintf(address.sun_path, sizeof(address.sun_path),
+                                     "%s/%s", out_dir, TRACE_SOCKET_FILE);
+    if ((0 > path_length) || ((size_t)path_length >= sizeof(address.sun_path)))
+        return -1;
+    // Send the report as a single datagram
+    int const fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (-1 == fd)
+        return -1;
+    ssize_t const sent = sendto(fd, buffer->data, buffer->size, 0,
+                                (struct sockaddr const *)&address, sizeof(address));
+    int const result = ((-1 == sent) || ((size_t)sent != buffer->size)) ? -1 : 0;
+    if (close(fd))
+        ERROR_AND_EXIT("close");
+    return result;
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+static int send_trace_ring(char const *const out_dir, buffer_t const *const buffer) {
+    // Map the ring only once, the next reports of this process reuse it.
+    pthread_mutex_lock(&mutex);
+    int const mapped = (ring.base) ? 0 : map_trace_ring(out_dir, &ring);
+    pthread_mutex_unlock(&mutex);
+    if (0 != mapped)
+        return -1;
+
+    uint64_t *const head = (uint64_t *)(ring.base + RING_HEAD_OFFSET);
+    uint64_t *const tail = (uint64_t *)(ring.base + RING_TAIL_OFFSET);
+    unsigned char *const data = ring.base + RING_DATA_OFFSET;
+    uint64_t const capacity = ring.capacity;
+    uint64_t const length = buffer->size;
+    uint64_t const size = (sizeof(uint64_t) + length + RING_ALIGN - 1) & ~(uint64_t)(RING_ALIGN - 1);
+    if (size > capacity / 2)
+        return -1;
+    // Reserve space for the record, unless the consumer is behind.
+    uint64_t position = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    do {
+        uint64_t const released = __atomic_load_n(tail, __ATOMIC_ACQUIRE);
+        if (position + size - released > capacity)
+            return -1;
+    } while (!__atomic_compare_exchange_n(head, &position, position + size, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    // Announce the length, so a torn record can be skipped by the consumer.
+    uint64_t *const record = (uint64_t *)(data + (position % capacity));
+    __atomic_store_n(record, length, __ATOMIC_RELAXED);
+    // Copy the payload, which might wrap around the end of the data area.
+    uint64_t const start = (position + sizeof(uint64_t)) % capacity;
+    uint64_t const first = (capacity - start < length) ? capacity - start : length;
+    memcpy(data + start, buffer->data, first);
+    memcpy(data, buffer->data + first, length - first);
+    // Commit the record.
+    uint64_t const stamp = ((position / RING_ALIGN) & 0x7fffffffu) | 0x80000000u;
+    __atomic_store_n(record, (stamp << 32) | length, __ATOMIC_RELEASE);
+    return 0;
+}
+#else
+static int send_trace_ring(char const *const out_dir, buffer_t const *const buffer) {
+    (void)out_dir;
+    (void)buffer;
+    return -1;
+}
+#endif
+
+static int map_trace_ring(char const *const out_dir, ring_t *const result) {
     size_t const path_max_length = strlen(out_dir) + 32;
     char filename[path_max_length];
-    if (-1 == snprintf(filename, path_max_length, "%s/execution.XXXXXX", out_dir))
+    if (-1 == snprintf(filename, path_max_length, "%s/%s", out_dir, TRACE_RING_FILE))
         ERROR_AND_EXIT("snprintf");
-    // Create report file
-    int fd = mkstemp((char *)&filename);
+    int const fd = open(filename, O_RDWR);
     if (-1 == fd)
-        ERROR_AND_EXIT("mkstemp");
-    // Write report file
-    write_report(fd, argv);
+        return -1;
+    struct stat info;
+    void *base = MAP_FAILED;
+    if ((0 == fstat(fd, &info)) && (info.st_size > RING_DATA_OFFSET))
+        base = mmap(0, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (close(fd))
+        ERROR_AND_EXIT("close");
+    if (MAP_FAILED == base)
+        return -1;
+    // Validate the header before use it.
+    uint32_t const *const magic = (uint32_t const *)base;
+    uint64_t const *const capacity = (uint64_t const *)((unsigned char const *)base + 8);
+    if ((RING_MAGIC != magic[0]) || (RING_VERSION != magic[1]) ||
+        (*capacity + RING_DATA_OFFSET > (uint64_t)info.st_size) ||
+        (0 != *capacity % RING_ALIGN)) {
+        munmap(base, (size_t)info.st_size);
+        return -1;
+    }
+    result->base = (unsigned char *)base;
+    result->size = (size_t)info.st_size;
+    result->capacity = *capacity;
+    return 0;
+}
+
+static void unmap_trace_ring(ring_t *const mapped) {
+    if (mapped->base)
+        munmap(mapped->base, mapped->size);
+    mapped->base = 0;
+    mapped->size = 0;
+    mapped->capacity = 0;
+}
+
+static void write_trace_file(char const *const out_dir, transport_t const mode, buffer_t const *const buffer) {
+    // Open the report file
+    int fd = open_trace_file(out_dir, mode);
+    if (-1 == fd)
+        ERROR_AND_EXIT("open");
+    // Write report with a single call. The shared log is opened in append
+    // mode, so concurrent writers can not interleave each others records.
+    ssize_t const written = write(fd, buffer->data, buffer->size);
+    if ((-1 == written) || ((size_t)written != buffer->size))
+        ERROR_AND_EXIT("write");
     // Close report file
     if (close(fd))
         ERROR_AND_EXIT("close");
 }
 
-static void write_report(int fd, char const *const argv[]) {
-    const locale_t saved_locale = uselocale(utf_locale);
-    if ((locale_t)0 == saved_locale)
-        ERROR_AND_EXIT("uselocale");
+static int open_trace_file(char const *const out_dir, transport_t const mode) {
+    size_t const path_max_length = strlen(out_dir) + 32;
+    char filename[path_max_length];
+    switch (mode) {
+    case TRANSPORT_LOG:
+        if (-1 == snprintf(filename, path_max_length, "%s/%s", out_dir, TRACE_LOG_FILE))
+            ERROR_AND_EXIT("snprintf");
+        return open(filename, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    case TRANSPORT_FILES:
+    case TRANSPORT_SOCKET:
+    case TRANSPORT_RING:
+    default:
+        if (-1 == snprintf(filename, path_max_length, "%s/%s", out_dir, TRACE_FILE_TEMPLATE))
+            ERROR_AND_EXIT("snprintf");
+        return mkstemp((char *)&filename);
+    }
+}
+
+static void write_formatted_report(buffer_t *const buffer, char const *const cmd[],
+                                   char const *const cwd, size_t const cwd_size, pid_t const pid) {
+    if (FORMAT_BINARY == format)
+        write_binary_report(buffer, cmd, cwd, cwd_size, pid);
+    else
+        write_json_report(buffer, cmd, cwd, cwd_size, pid);
+}
 
+static void write_report(buffer_t *const buffer, char const *const argv[]) {
+    pid_t const pid = getpid();
+    // Use the cached working directory, when it's still the current one.
+    // (It's copied out, the report is not written while holding the lock.)
+    if (cwd_cache_enabled) {
+        buffer_t cached;
+        buffer_init(&cached, -1);
+        pthread_mutex_lock(&cwd_mutex);
+        int const valid = cwd_cache_check(&cwd_cache) || (0 == cwd_cache_update(&cwd_cache));
+        if (valid)
+            buffer_append(&cached, cwd_cache.encoded, cwd_cache.size);
+        pthread_mutex_unlock(&cwd_mutex);
+        if (valid)
+            write_formatted_report(buffer, argv, cached.data, cached.size, pid);
+        buffer_release(&cached);
+        if (valid)
+            return;
+    }
     const char *cwd = getcwd(NULL, 0);
     if (0 == cwd)
         ERROR_AND_EXIT("getcwd");
-    if (write_json_report(fd, argv, cwd, getpid()))
-        ERROR_AND_EXIT("writing json problem");
+    buffer_t encoded;
+    buffer_init(&encoded, -1);
+    encode_cwd(cwd, &encoded);
+    write_formatted_report(buffer, argv, encoded.data, encoded.size, pid);
+    buffer_release(&encoded);
     free((void *)cwd);
+}
 
-    const locale_t restored_locale = uselocale(saved_locale);
-    if ((locale_t)0 == restored_locale)
-        ERROR_AND_EXIT("uselocale");
+/* The cache is usable when it was not marked stale, the current directory
+ * is still the same directory, and the cached path still names it. (The
+ * directory might be moved away, and another one created on its path.) */
+static int cwd_cache_check(cwd_cache_t const *const cache) {
+    if ((!cache->valid) || (0 == cache->encoded) || (0 == cache->path))
+        return 0;
+    struct stat current;
+    if ((0 != stat(".", &current)) || (current.st_dev != cache->device) || (current.st_ino != cache->inode))
+        return 0;
+    struct stat named;
+    if ((0 != stat(cache->path, &named)) || (named.st_dev != cache->device) || (named.st_ino != cache->inode))
+        return 0;
+    return 1;
 }
 
-static int write_json_report(int fd, char const *const cmd[], char const *const cwd, pid_t pid) {
-    if (0 > dprintf(fd, "{ \"pid\": %d, \"cmd\": [", pid))
+static int cwd_cache_update(cwd_cache_t *const cache) {
+    cwd_cache_release(cache);
+    // Take the identity first, a change after that makes it stale.
+    struct stat info;
+    if (0 != stat(".", &info))
         return -1;
+    char *const cwd = getcwd(NULL, 0);
+    if (0 == cwd)
+        return -1;
+    buffer_t encoded;
+    buffer_init(&encoded, -1);
+    encode_cwd(cwd, &encoded);
+    char *const copy = malloc(encoded.size ? encoded.size : 1);
+    if (0 == copy)
+        ERROR_AND_EXIT("malloc");
+    memcpy(copy, encoded.data, encoded.size);
+    cache->path = cwd;
+    cache->encoded = copy;
+    cache->size = encoded.size;
+    cache->device = info.st_dev;
+    cache->inode = info.st_ino;
+    cache->valid = 1;
+    buffer_release(&encoded);
+    return 0;
+}
+
+/* It only marks the cache stale, the update happens at the next report.
+ * (The memory is not released here, because this might be called from a
+ * child process which shares the memory with the parent after 'vfork'.) */
+static void cwd_cache_drop(void) {
+    if (!cwd_cache_enabled)
+        return;
+    pthread_mutex_lock(&cwd_mutex);
+    cwd_cache.valid = 0;
+    pthread_mutex_unlock(&cwd_mutex);
+}
+
+static void cwd_cache_release(cwd_cache_t *const cache) {
+    free((void *)cache->path);
+    cache->path = 0;
+    free((void *)cache->encoded);
+    cache->encoded = 0;
+    cache->size = 0;
+    cache->valid = 0;
+}
+
+/* The report is a single line JSON object. The working directory is given
+ * already encoded. Control characters are escaped in the strings, therefore the new line character separates the records
+ * when multiple reports are written into the same file. */
+static void write_json_report(buffer_t *const buffer, char const *const cmd[], char const *const cwd, size_t const cwd_size, pid_t pid) {
+    char header[64];
+    int const header_length = snprintf(header, sizeof(header), "{ \"pid\": %d, \"cmd\": [", pid);
+    if (0 > header_length)
+        ERROR_AND_EXIT("snprintf");
+    buffer_append(buffer, header, (size_t)header_length);
 
     for (char const *const *it = cmd; (it) && (*it); ++it) {
-        char const *const sep = (it != cmd) ? "," : "";
-        const size_t buffer_size = (6 * strlen(*it)) + 1;
-        char buffer[buffer_size];
-        if (-1 == encode_json_string(*it, buffer, buffer_size))
-            return -1;
-        if (0 > dprintf(fd, "%s \"%s\"", sep, buffer))
-            return -1;
+        char const *const sep = (it != cmd) ? ", \"" : " \"";
+        buffer_append(buffer, sep, strlen(sep));
+        encode_json_string(*it, buffer);
+        buffer_append(buffer, "\"", 1);
     }
-    const size_t buffer_size = 6 * strlen(cwd);
-    char buffer[buffer_size];
-    if (-1 == encode_json_string(cwd, buffer, buffer_size))
-        return -1;
-    if (0 > dprintf(fd, "], \"cwd\": \"%s\" }", buffer))
-        return -1;
+    char const *const cwd_key = "], \"cwd\": \"";
+    buffer_append(buffer, cwd_key, strlen(cwd_key));
+    buffer_append(buffer, cwd, cwd_size);
+    char const *const trailer = "\" }\n";
+    buffer_append(buffer, trailer, strlen(trailer));
+}
+
+/* The binary report needs the length up front, so the strings are visited
+ * twice. But those are copied without any encoding. */
+static void write_binary_report(buffer_t *const buffer, char const *const cmd[], char const *const cwd, size_t const cwd_size, pid_t pid) {
+    size_t length = cwd_size + 1;
+    uint32_t argc = 0;
+    for (char const *const *it = cmd; (it) && (*it); ++it, ++argc)
+        length += strlen(*it) + 1;
+    if (length > UINT32_MAX)
+        ERROR_AND_EXIT("report too long");
+
+    record_header_t header;
+    memcpy(header.tag, RECORD_TAG, sizeof(header.tag));
+    header.version = RECORD_VERSION;
+    header.length = (uint32_t)length;
+    header.pid = (int32_t)pid;
+    header.argc = argc;
+    buffer_append(buffer, (char const *)&header, sizeof(header));
+
+    buffer_append(buffer, cwd, cwd_size);
+    buffer_append(buffer, "", 1);
+    for (char const *const *it = cmd; (it) && (*it); ++it)
+        buffer_append(buffer, *it, strlen(*it) + 1);
+}
 
+/* Returns a monotonic time stamp in nanoseconds. (It's the same clock for
+ * every process, so those time stamps are comparable.) */
+static uint64_t monotonic_ns(void) {
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
     return 0;
 }
 
-static int encode_json_string(char const *const src, char *const dst, size_t const dst_size) {
-    size_t const wsrc_length = mbstowcs(NULL, src, 0);
-    wchar_t wsrc[wsrc_length + 1];
-    if (mbstowcs((wchar_t *)&wsrc, src, wsrc_length + 1) != wsrc_length) {
-        PERROR("mbstowcs");
-        return -1;
+static void stats_count_call(entry_t const entry, uint64_t const duration, size_t const bytes) {
+    STATS_ADD(stats.calls[entry], 1);
+    if (0 == bytes)
+        return;
+    size_t bucket = 0;
+    for (uint64_t it = duration >> 1; (it) && (bucket < STATS_BUCKETS - 1); it >>= 1)
+        ++bucket;
+    STATS_ADD(stats.reports, 1);
+    STATS_ADD(stats.report_ns, duration);
+    STATS_ADD(stats.histogram[bucket], 1);
+    STATS_ADD(stats.bytes, bytes);
+}
+
+#ifndef HAVE_ATOMIC_BUILTINS
+static uint64_t stats_take(uint64_t *const value) {
+    uint64_t const result = *value;
+    *value = 0;
+    return result;
+}
+#endif
+
+static void stats_append(buffer_t *const buffer, char const *const fmt, char const *const name, uint64_t const value) {
+    char entry[128];
+    int const length = snprintf(entry, sizeof(entry), fmt, name, (unsigned long long)value);
+    if ((0 < length) && ((size_t)length < sizeof(entry)))
+        buffer_append(buffer, entry, (size_t)length);
+}
+
+/* The counters of the parent process are not inherited by a forked child,
+ * those are written by the parent. (It's a 'pthread_atfork' child handler.) */
+static void stats_reset(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+/* Appends the counters as a single line JSON object to the statistics file
+ * and resets those. Processes without intercepted calls write nothing. */
+static void stats_flush(void) {
+    if (!stats_enabled)
+        return;
+    stats_t current;
+    uint64_t total = 0;
+    for (size_t it = 0; it < ENTRY_SIZE; ++it)
+        total += current.calls[it] = STATS_TAKE(stats.calls[it]);
+    current.reports = STATS_TAKE(stats.reports);
+    current.report_ns = STATS_TAKE(stats.report_ns);
+    for (size_t it = 0; it < STATS_BUCKETS; ++it)
+        current.histogram[it] = STATS_TAKE(stats.histogram[it]);
+    current.bytes = STATS_TAKE(stats.bytes);
+    current.env_patches = STATS_TAKE(stats.env_patches);
+    current.env_allocations = STATS_TAKE(stats.env_allocations);
+    if ((0 == total) && (0 == current.env_patches))
+        return;
+
+    buffer_t buffer;
+    buffer_init(&buffer, -1);
+    stats_append(&buffer, "{ \"%s\": %llu, \"program\": \"", "pid", (uint64_t)getpid());
+#if defined HAVE_PROGRAM_INVOCATION_NAME
+    encode_json_string(program_invocation_name, &buffer);
+#elif defined HAVE_GETPROGNAME
+    encode_json_string(getprogname(), &buffer);
+#endif
+    buffer_append(&buffer, "\", \"calls\": {", strlen("\", \"calls\": {"));
+    char const *separator = " ";
+    for (size_t it = 0; it < ENTRY_SIZE; ++it) {
+        if (0 == current.calls[it])
+            continue;
+        buffer_append(&buffer, separator, strlen(separator));
+        stats_append(&buffer, "\"%s\": %llu", entry_names[it], current.calls[it]);
+        separator = ", ";
     }
-    wchar_t const *wsrc_it = (wchar_t const *)&wsrc;
-    wchar_t const *const wsrc_end = wsrc_it + wsrc_length;
+    stats_append(&buffer, " }, \"%s\": %llu", "reports", current.reports);
+    stats_append(&buffer, ", \"%s\": %llu", "report_ns", current.report_ns);
+    stats_append(&buffer, ", \"%s\": %llu", "bytes", current.bytes);
+    stats_append(&buffer, ", \"%s\": %llu", "env_patches", current.env_patches);
+    stats_append(&buffer, ", \"%s\": %llu", "env_allocations", current.env_allocations);
+    // The histogram is written until the last not empty bucket.
+    size_t used = STATS_BUCKETS;
+    while ((used) && (0 == current.histogram[used - 1]))
+        --used;
+    buffer_append(&buffer, ", \"histogram\": [", strlen(", \"histogram\": ["));
+    for (size_t it = 0; it < used; ++it)
+        stats_append(&buffer, "%s%llu", (it) ? ", " : "", current.histogram[it]);
+    buffer_append(&buffer, "] }\n", strlen("] }\n"));
+
+    append_trace_log(TRACE_STATS_FILE, &buffer);
+    buffer_release(&buffer);
+}
 
-    char *dst_it = dst;
-    char *const dst_end = dst + dst_size;
+/* Appends a single line JSON object to the timeline file about the start
+ * of a process. (The process might replace its image more times, each of
+ * those is a new start.) The parent is given by the caller, because the
+ * spawned processes are written by the parent itself. */
+static void timeline_start(pid_t const pid, pid_t const ppid, char const *const argv[], uint64_t const time) {
+    buffer_t buffer;
+    buffer_init(&buffer, -1);
+    stats_append(&buffer, "{ \"event\": \"%s\", \"time\": %llu", "start", time);
+    stats_append(&buffer, ", \"%s\": %llu", "pid", (uint64_t)pid);
+    stats_append(&buffer, ", \"%s\": %llu", "ppid", (uint64_t)ppid);
+    char const *const cmd_key = ", \"cmd\": [";
+    buffer_append(&buffer, cmd_key, strlen(cmd_key));
+    for (char const *const *it = argv; (it) && (*it); ++it) {
+        char const *const sep = (it != argv) ? ", \"" : " \"";
+        buffer_append(&buffer, sep, strlen(sep));
+        encode_json_string(*it, &buffer);
+        buffer_append(&buffer, "\"", 1);
+    }
+    char const *const trailer = "] }\n";
+    buffer_append(&buffer, trailer, strlen(trailer));
+    append_trace_file(timeline_file, buffer.data, buffer.size);
+    buffer_release(&buffer);
+}
 
-    for (; wsrc_it != wsrc_end; ++wsrc_it) {
-        if (dst_it >= dst_end) {
-            return -1;
+/* Appends a single line JSON object to the timeline file about the end of
+ * a child process. It might run in a signal handler, therefore it uses
+ * only async-signal-safe calls: the record is formatted by hand into a
+ * stack buffer, and written to the path which was built at load. */
+static void timeline_exit(pid_t const pid, int const status, struct rusage const *const usage) {
+    uint64_t const values[] =
+        { monotonic_ns()
+        , (uint64_t)pid
+        , (uint64_t)(unsigned int)status
+        , (uint64_t)usage->ru_utime.tv_sec * 1000000u + (uint64_t)usage->ru_utime.tv_usec
+        , (uint64_t)usage->ru_stime.tv_sec * 1000000u + (uint64_t)usage->ru_stime.tv_usec
+        , (uint64_t)usage->ru_maxrss
+        };
+    char const *const keys[] =
+        { "{ \"event\": \"exit\", \"time\": "
+        , ", \"pid\": "
+        , ", \"status\": "
+        , ", \"utime_us\": "
+        , ", \"stime_us\": "
+        , ", \"maxrss\": "
+        };
+    // The keys are less than 32 bytes, the values are 20 digits at most.
+    char record[sizeof(keys) / sizeof(keys[0]) * (32 + 20) + 4];
+    size_t size = 0;
+    for (size_t it = 0; it < sizeof(keys) / sizeof(keys[0]); ++it) {
+        size_t const length = strlen(keys[it]);
+        memcpy(record + size, keys[it], length);
+        size += length;
+        size += format_decimal(record + size, values[it]);
+    }
+    memcpy(record + size, " }\n", 3);
+    size += 3;
+    append_trace_file(timeline_file, record, size);
+}
+
+/* Writes the decimal digits of the value (without terminating zero), and
+ * returns the number of those. (The printf family is not async-signal-safe,
+ * this is the replacement of it for the timeline.) */
+static size_t format_decimal(char *const dst, uint64_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    for (size_t it = 0; it < count; ++it)
+        dst[it] = digits[count - 1 - it];
+    return count;
+}
+
+/* Appends the buffer to the given file in the target directory. */
+static void append_trace_log(char const *const name, buffer_t const *const buffer) {
+    char const *const out_dir = initial_env[ENV_OUTPUT_IDX];
+    size_t const path_max_length = strlen(out_dir) + strlen(name) + 2;
+    char filename[path_max_length];
+    if (0 < snprintf(filename, path_max_length, "%s/%s", out_dir, name))
+        append_trace_file(filename, buffer->data, buffer->size);
+}
+
+/* Appends the data to the given file with a single write, so concurrent
+ * writers can not interleave. (Failures are ignored, the statistics and the
+ * timeline shall not break the build.) */
+static void append_trace_file(char const *const path, char const *const data, size_t const size) {
+    int const fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (-1 != fd) {
+        ssize_t const written = write(fd, data, size);
+        (void)written;
+        close(fd);
+    }
+}
+
+/* Encode the working directory as it goes into the report. */
+static void encode_cwd(char const *const cwd, buffer_t *const buffer) {
+    if (FORMAT_BINARY == format)
+        buffer_append(buffer, cwd, strlen(cwd));
+    else
+        encode_json_string(cwd, buffer);
+}
+
+/* Tells if any byte of the word is a control character, a quote, a
+ * backslash or a non ASCII character. (It might report false positive,
+ * but only after a byte which needs attention.) */
+#define WORD_ONES       (~(uint64_t)0 / 255)
+#define WORD_HAS_ZERO(W_) (((W_) - WORD_ONES) & ~(W_) & (WORD_ONES * 0x80))
+#define WORD_NEEDS_ESCAPE(W_)                                       \
+    ((((W_) - WORD_ONES * 0x20) & ~(W_) & (WORD_ONES * 0x80)) |     \
+     WORD_HAS_ZERO((W_) ^ (WORD_ONES * '"')) |                      \
+     WORD_HAS_ZERO((W_) ^ (WORD_ONES * '\\')) |                     \
+     ((W_) & (WORD_ONES * 0x80)))
+
+/* Encode the string as JSON string content. The input is taken as bytes.
+ * Clean runs are copied as they are, these are found a word at a time.
+ * Valid UTF-8 multi-byte sequences are copied too, control characters
+ * are escaped. Bytes which are not part of a valid UTF-8 sequence are
+ * taken as Latin-1 characters and escaped, this way the output is always
+ * valid UTF-8. */
+static void encode_json_string(char const *const src, buffer_t *const buffer) {
+    unsigned char const *it = (unsigned char const *)src;
+    unsigned char const *const end = it + strlen(src);
+    unsigned char const *run = it;
+
+    while (it < end) {
+        // Skip the clean bytes a word at a time.
+        while ((size_t)(end - it) >= sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, it, sizeof(word));
+            if (WORD_NEEDS_ESCAPE(word))
+                break;
+            it += sizeof(word);
         }
-        // Insert an escape character before control characters.
-        switch (*wsrc_it) {
-        case L'\b':
-            dst_it += snprintf(dst_it, 3, "\\b");
-            break;
-        case L'\f':
-            dst_it += snprintf(dst_it, 3, "\\f");
-            break;
-        case L'\n':
-            dst_it += snprintf(dst_it, 3, "\\n");
-            break;
-        case L'\r':
-            dst_it += snprintf(dst_it, 3, "\\r");
+        // Find the next byte which needs attention.
+        while ((it < end) && (*it >= 0x20) && (*it < 0x80) && (*it != '"') && (*it != '\\'))
+            ++it;
+        if (it >= end)
             break;
-        case L'\t':
-            dst_it += snprintf(dst_it, 3, "\\t");
-            break;
-        case L'"':
-            dst_it += snprintf(dst_it, 3, "\\\"");
-            break;
-        case L'\\':
-            dst_it += snprintf(dst_it, 3, "\\\\");
-            break;
-        default:
-            if ((*wsrc_it < L' ') || (*wsrc_it > 127)) {
-                dst_it += snprintf(dst_it, 7, "\\u%04x", (unsigned int)*wsrc_it);
-            } else {
-                *dst_it++ = (char)*wsrc_it;
+        // Copy multi-byte characters, when those are valid.
+        if (*it >= 0x80) {
+            size_t const length = utf8_sequence_length(it);
+            if (length) {
+                it += length;
+                continue;
             }
+        }
+        // Copy the clean run and escape the current byte.
+        buffer_append(buffer, (char const *)run, (size_t)(it - run));
+        char escape[8] = { '\\', 0 };
+        size_t escape_length = 2;
+        switch (*it) {
+        case '\b': escape[1] = 'b'; break;
+        case '\f': escape[1] = 'f'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        case '"': escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        default: {
+            static char const hex[] = "0123456789abcdef";
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = hex[*it >> 4];
+            escape[5] = hex[*it & 0x0f];
+            escape_length = 6;
             break;
         }
+        }
+        buffer_append(buffer, escape, escape_length);
+        run = ++it;
     }
-    if (dst_it < dst_end) {
-        // Insert a terminating 0 value.
-        *dst_it = 0;
+    buffer_append(buffer, (char const *)run, (size_t)(end - run));
+}
+
+/* Returns the length of the valid UTF-8 multi-byte sequence, or zero when
+ * it's not valid. (Overlong forms and surrogates are not valid.) */
+static size_t utf8_sequence_length(unsigned char const *const it) {
+    unsigned char const lead = it[0];
+    unsigned char low = 0x80;
+    unsigned char high = 0xbf;
+    size_t length = 0;
+    if ((lead >= 0xc2) && (lead <= 0xdf)) {
+        length = 2;
+    } else if ((lead >= 0xe0) && (lead <= 0xef)) {
+        length = 3;
+        low = (0xe0 == lead) ? 0xa0 : 0x80;
+        high = (0xed == lead) ? 0x9f : 0xbf;
+    } else if ((lead >= 0xf0) && (lead <= 0xf4)) {
+        length = 4;
+        low = (0xf0 == lead) ? 0x90 : 0x80;
+        high = (0xf4 == lead) ? 0x8f : 0xbf;
+    } else {
         return 0;
     }
-    return -1;
+    // The terminating zero byte fails this check, so it won't overrun.
+    if ((it[1] < low) || (it[1] > high))
+        return 0;
+    for (size_t idx = 2; idx < length; ++idx)
+        if ((it[idx] < 0x80) || (it[idx] > 0xbf))
+            return 0;
+    return length;
+}
+
+/* util methods to deal with the report buffer. */
+
+static void buffer_init(buffer_t *const buffer, int const fd) {
+    buffer->data = buffer->storage;
+    buffer->size = 0;
+    buffer->capacity = sizeof(buffer->storage);
+    buffer->written = 0;
+    buffer->fd = fd;
+}
+
+static void buffer_append(buffer_t *const buffer, char const *data, size_t size) {
+    while (buffer->size + size > buffer->capacity) {
+        if (-1 != buffer->fd) {
+            // Fill the buffer and flush it.
+            size_t const chunk = buffer->capacity - buffer->size;
+            memcpy(buffer->data + buffer->size, data, chunk);
+            buffer->size += chunk;
+            data += chunk;
+            size -= chunk;
+            buffer_flush(buffer);
+        } else {
+            // Move the content to the heap, or grow it there.
+            size_t const capacity = buffer->capacity * 2;
+            char *const heap = (buffer->data == buffer->storage)
+                ? malloc(capacity)
+                : realloc(buffer->data, capacity);
+            if (0 == heap)
+                ERROR_AND_EXIT("realloc");
+            if (buffer->data == buffer->storage)
+                memcpy(heap, buffer->storage, buffer->size);
+            buffer->data = heap;
+            buffer->capacity = capacity;
+        }
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void buffer_flush(buffer_t *const buffer) {
+    char const *it = buffer->data;
+    char const *const end = it + buffer->size;
+    while (it < end) {
+        ssize_t const written = write(buffer->fd, it, (size_t)(end - it));
+        if (-1 == written) {
+            if (EINTR == errno)
+                continue;
+            ERROR_AND_EXIT("write");
+        }
+        it += written;
+        buffer->written += (size_t)written;
+    }
+    buffer->size = 0;
+}
+
+static void buffer_release(buffer_t *const buffer) {
+    if (buffer->data != buffer->storage)
+        free((void *)buffer->data);
+    buffer_init(buffer, -1);
 }
 
 /* update environment assure that chilren processes will copy the desired
  * behaviour */
 
-static int capture_env_t(bear_env_t *env) {
-    int status = 1;
+/* Captures the relevant variables from the environment. The entries are
+ * copied once, in "name=value" form for the child processes, and the values
+ * point into those copies. */
+static int capture_env_t(bear_env_t *env, bear_env_t *entries) {
     for (size_t it = 0; it < ENV_SIZE; ++it) {
-        char const * const env_value = getenv(env_names[it]);
-        char const * const env_copy = (env_value) ? strdup(env_value) : env_value;
-        (*env)[it] = env_copy;
-        status &= (env_copy) ? 1 : 0;
-        // Just report the problem, but don't roll back.
-        if (0 == status)
-            PERROR("strdup");
+        (*env)[it] = 0;
+        (*entries)[it] = 0;
+    }
+    size_t total = 0;
+    for (char const *const *it = (char const *const *)environ; (it) && (*it); ++it) {
+        size_t const idx = env_entry_index(*it);
+        if ((ENV_SIZE == idx) || (0 != (*entries)[idx]))
+            continue;
+        (*entries)[idx] = *it;
+        total += strlen(*it) + 1;
     }
+    char *storage = env_storage;
+    if (total > sizeof(env_storage)) {
+        storage = env_storage_heap = malloc(total);
+        if (0 == storage)
+            ERROR_AND_EXIT("malloc");
+    }
+    for (size_t it = 0; it < ENV_SIZE; ++it) {
+        if (0 == (*entries)[it])
+            continue;
+        size_t const length = strlen((*entries)[it]) + 1;
+        memcpy(storage, (*entries)[it], length);
+        (*entries)[it] = storage;
+        (*env)[it] = storage + strlen(env_names[it]) + 1;
+        storage += length;
+    }
+    // Optional variables are not required to be present.
+    int status = 1;
+    for (size_t it = 0; it < ENV_MANDATORY_SIZE; ++it)
+        status &= ((*env)[it]) ? 1 : 0;
     return status;
 }
 
 static void release_env_t(bear_env_t *env) {
-    for (size_t it = 0; it < ENV_SIZE; ++it) {
-        free((void *)(*env)[it]);
+    for (size_t it = 0; it < ENV_SIZE; ++it)
         (*env)[it] = 0;
-    }
 }
 
-static char const **string_array_partial_update(char *const envp[], bear_env_t *env) {
-    char const **result = string_array_copy((char const **)envp);
-    for (size_t it = 0; it < ENV_SIZE && (*env)[it]; ++it)
-        result = string_array_single_update(result, env_names[it], (*env)[it]);
-    return result;
+static transport_t parse_transport(char const *const value) {
+    if ((value) && (0 == strcmp(value, "log")))
+        return TRANSPORT_LOG;
+    if ((value) && (0 == strcmp(value, "socket")))
+        return TRANSPORT_SOCKET;
+    if ((value) && (0 == strcmp(value, "ring")))
+        return TRANSPORT_RING;
+    return TRANSPORT_FILES;
 }
 
-static char const **string_array_single_update(char const *envs[], char const *key, char const * const value) {
-    // find the key if it's there
-    size_t const key_length = strlen(key);
-    char const **it = envs;
-    for (; (it) && (*it); ++it) {
-        if ((0 == strncmp(*it, key, key_length)) &&
-            (strlen(*it) > key_length) && ('=' == (*it)[key_length]))
-            break;
+static format_t parse_format(char const *const value) {
+    if ((value) && (0 == strcmp(value, "binary")))
+        return FORMAT_BINARY;
+    return FORMAT_JSON;
+}
+
+/* Returns the index of the captured variable which the entry defines, or
+ * ENV_SIZE when it's not one of those. */
+static size_t env_entry_index(char const *const entry) {
+    for (size_t it = 0; it < ENV_SIZE; ++it) {
+        char const *const name = env_names[it];
+        if (name[0] != entry[0])
+            continue;
+        size_t const name_length = strlen(name);
+        if ((0 == strncmp(entry, name, name_length)) && ('=' == entry[name_length]))
+            return it;
     }
-    // allocate a environment entry
-    size_t const value_length = strlen(value);
-    size_t const env_length = key_length + value_length + 2;
-    char *env = malloc(env_length);
-    if (0 == env)
-        ERROR_AND_EXIT("malloc");
-    if (-1 == snprintf(env, env_length, "%s=%s", key, value))
-        ERROR_AND_EXIT("snprintf");
-    // replace or append the environment entry
-    if (it && *it) {
-        free((void *)*it);
-        *it = env;
-	    return envs;
-    } else {
-        size_t const size = string_array_length(envs);
-        char const **result = realloc(envs, (size + 2) * sizeof(char const *));
+    return ENV_SIZE;
+}
+
+/* Creates the environment for the child process. The entries of the given
+ * environment are not copied, only a new pointer array is created, where
+ * the captured entries replace or extend the given ones. (When the child
+ * process is a compiler driver, the driver marker is added too.) When the
+ * given environment already has the captured values, it's returned as it
+ * is. The pointer array is created in the given storage when it fits,
+ * otherwise it's allocated on the heap. */
+static char const **env_patch(char *const argv[], char *const envp[], char const **storage, size_t storage_size) {
+    char const *entries[ENV_SIZE];
+    memcpy((void *)entries, (void const *)initial_entries, sizeof(entries));
+    if (is_driver((char const *const *)argv))
+        entries[ENV_DRIVER_IDX] = driver_entry;
+    size_t const size = string_array_length((char const *const *)envp);
+    // Find the captured variables in the given environment.
+    size_t found[ENV_SIZE];
+    for (size_t it = 0; it < ENV_SIZE; ++it)
+        found[it] = size;
+    for (size_t it = 0; it < size; ++it) {
+        size_t const idx = env_entry_index(envp[it]);
+        if ((ENV_SIZE != idx) && (size == found[idx]))
+            found[idx] = it;
+    }
+    // Check if those need to be updated.
+    size_t missing = 0;
+    int changed = 0;
+    for (size_t it = 0; it < ENV_SIZE; ++it) {
+        if (0 == entries[it])
+            continue;
+        if (size == found[it])
+            ++missing;
+        else if (0 != strcmp(envp[found[it]], entries[it]))
+            changed = 1;
+    }
+    if ((0 == missing) && (0 == changed))
+        return (char const **)envp;
+    // Create the new pointer array.
+    char const **result = storage;
+    if (size + missing + 1 > storage_size) {
+        result = malloc((size + missing + 1) * sizeof(char const *));
         if (0 == result)
-            ERROR_AND_EXIT("realloc");
-        result[size] = env;
-        result[size + 1] = 0;
-        return result;
+            ERROR_AND_EXIT("malloc");
+        if (stats_enabled)
+            STATS_ADD(stats.env_allocations, 1);
+    }
+    if (stats_enabled)
+        STATS_ADD(stats.env_patches, 1);
+    if (size)
+        memcpy((void *)result, (void const *)envp, size * sizeof(char const *));
+    size_t end = size;
+    for (size_t it = 0; it < ENV_SIZE; ++it) {
+        if (0 == entries[it])
+            continue;
+        if (size == found[it])
+            result[end++] = entries[it];
+        else
+            result[found[it]] = entries[it];
     }
+    result[end] = 0;
+    return result;
+}
+
+static void env_patch_release(char const **patched, char *const envp[], char const **storage) {
+    if ((patched != (char const **)envp) && (patched != storage))
+        free((void *)patched);
 }
 
 /* util methods to deal with string arrays. environment and process arguments
@@ -666,24 +1932,6 @@ static char const **string_array_from_varargs(char const *const arg, va_list *ar
     return result;
 }
 
-static char const **string_array_copy(char const **const in) {
-    size_t const size = string_array_length(in);
-
-    char const **const result = malloc((size + 1) * sizeof(char const *));
-    if (0 == result)
-        ERROR_AND_EXIT("malloc");
-
-    char const **out_it = result;
-    for (char const *const *in_it = in; (in_it) && (*in_it);
-         ++in_it, ++out_it) {
-        *out_it = strdup(*in_it);
-        if (0 == *out_it)
-            ERROR_AND_EXIT("strdup");
-    }
-    *out_it = 0;
-    return result;
-}
-
 static size_t string_array_length(char const *const *const in) {
     size_t result = 0;
     for (char const *const *it = in; (it) && (*it); ++it)
@@ -0,0 +1,330 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+# Copyright (C) 2012-2017 by László Nagy
+# This file is part of Bear.
+#
+# Bear is a tool to generate compilation database for clang tooling.
+#
+# Bear is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Bear is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+""" Throughput benchmark of the execution report post-processing.
+
+It generates a synthetic trace directory (as the preload library would
+write it during a build), and runs the stages of the post-processing on
+it: parse the trace files, classify the executions, deduplicate the
+compilations and save the compilation database. The stages are timed
+separately (therefore the intermediate results are kept in memory between
+the stages), and the peak memory usage is reported after each of them.
+
+The corpus is reproducible: the same seed and sizes generate the same
+records (with the same Python version). The records are a mix of compiler
+calls (plain, behind compiler wrappers and MPI compiler wrappers) and other
+commands of a build, with the given ratio of duplicate compiler calls. """
+
+import argparse
+import functools
+import itertools
+import json
+import os
+import os.path
+import random
+import resource
+import shutil
+import stat
+import sys
+import tempfile
+import time
+
+COMPILERS = ['cc', 'gcc', 'clang', 'c++', 'g++', 'clang++']
+WRAPPERS = ['ccache', 'distcc']
+MPI_WRAPPERS = ['mpicc', 'mpicxx']
+OTHER_COMMANDS = [
+    ['/bin/sh', '-c', 'true'],
+    ['make', '-C', 'lib', 'all'],
+    ['ar', 'rcs', 'libfoo.a', 'one.o', 'two.o', 'three.o'],
+    ['cc', '-o', 'app', 'one.o', 'two.o', '-lfoo', '-lm'],
+    ['cc', '-E', '-dM', '-'],
+    ['install', '-m', '0644', 'foo.h', '/usr/local/include'],
+    ['sed', '-e', 's/@VERSION@/1.0/', 'config.h.in'],
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--bear', required=True,
+                        help='the bear script to benchmark')
+    parser.add_argument('--records', type=int, default=100000,
+                        help='the number of execution reports')
+    parser.add_argument('--per-file', type=int, default=1,
+                        help='the number of reports per trace file')
+    parser.add_argument('--format', choices=['json', 'binary'],
+                        default='json', help='the report format')
+    parser.add_argument('--sources', type=int, default=10000,
+                        help='the number of source files')
+    parser.add_argument('--arguments', type=int, default=40,
+                        help='the average length of a compiler call')
+    parser.add_argument('--duplicates', type=float, default=0.2,
+                        help='the ratio of repeated compiler calls')
+    parser.add_argument('--wrappers', type=float, default=0.1,
+                        help='the ratio of compiler wrapper calls')
+    parser.add_argument('--mpi', type=float, default=0.05,
+                        help='the ratio of MPI compiler wrapper calls')
+    parser.add_argument('--others', type=float, default=0.3,
+                        help='the ratio of non compiler calls')
+    parser.add_argument('--jobs', type=int, default=1,
+                        help='parse and classify with worker processes')
+    parser.add_argument('--memory-limit', type=int,
+                        help='deduplicate within a memory limit (MiB)')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--keep', metavar='<directory>',
+                        help='generate the corpus into this directory and '
+                             'keep it')
+    args = parser.parse_args()
+
+    bear = load_bear(args.bear)
+    directory = args.keep or tempfile.mkdtemp(prefix='bear-bench-')
+    try:
+        run(bear, args, directory)
+    finally:
+        if not args.keep:
+            shutil.rmtree(directory, ignore_errors=True)
+    return 0
+
+
+def load_bear(path):
+    """ Loads the bear script as a module. (It's registered as 'bear', so
+    the worker processes can pickle its classes.) """
+
+    try:
+        import importlib.machinery
+        import importlib.util
+        loader = importlib.machinery.SourceFileLoader('bear', path)
+        spec = importlib.util.spec_from_loader('bear', loader)
+        module = importlib.util.module_from_spec(spec)
+        loader.exec_module(module)
+    except ImportError:
+        import imp
+        module = imp.load_source('bear', path)
+    sys.modules['bear'] = module
+    return module
+
+
+def run(bear, args, directory):
+    report = Report()
+    with report.stage('generate', args.records):
+        files, size = generate(bear, args, directory)
+    print('corpus: {0} records in {1} files ({2}), {3:.1f} MB'.format(
+        args.records, len(files), args.format, size / 1e6))
+
+    if args.jobs > 1:
+        with report.stage('parse+classify', args.records):
+            current = list(bear.parse_exec_traces(
+                files, 'cc', 'c++', args.jobs))
+    else:
+        with report.stage('parse', args.records):
+            calls = list(itertools.chain.from_iterable(
+                bear.parse_exec_trace(file) for file in files))
+        with report.stage('classify', len(calls)):
+            current = list(bear.compilations(calls, 'cc', 'c++'))
+        del calls
+
+    limit = args.memory_limit * 1024 * 1024 if args.memory_limit else None
+    result = bear.Deduplicator(limit)
+    with report.stage('dedupe', len(current)):
+        result.extend(current)
+    count = len(current)
+    del current
+
+    output = os.path.join(directory, 'compile_commands.json')
+    with report.stage('save', count):
+        bear.CompilationDatabase.save(output, result)
+    with open(output, 'r') as handle:
+        entries = len(json.load(handle))
+    print('result: {0} compilations, {1} entries, {2:.1f} MB'.format(
+        count, entries, os.path.getsize(output) / 1e6))
+    report.dump()
+
+
+class Report(object):
+    """ Collects the timing and the memory usage of the stages. """
+
+    def __init__(self):
+        self.rows = []
+
+    def stage(self, name, count):
+        return Stage(self, name, count)
+
+    def dump(self):
+        print('{0:<16} {1:>10} {2:>12} {3:>14}'.format(
+            'stage', 'seconds', 'records/s', 'peak RSS MB'))
+        for name, count, elapsed, peak in self.rows:
+            print('{0:<16} {1:>10.2f} {2:>12.0f} {3:>14.1f}'.format(
+                name, elapsed, count / elapsed if elapsed else 0, peak))
+        total = sum(row[2] for row in self.rows[1:])
+        print('{0:<16} {1:>10.2f}'.format('total (no gen)', total))
+
+
+class Stage(object):
+    def __init__(self, report, name, count):
+        self.report = report
+        self.name = name
+        self.count = count
+        self.start = None
+
+    def __enter__(self):
+        self.start = time.time()
+
+    def __exit__(self, *_):
+        elapsed = time.time() - self.start
+        self.report.rows.append((self.name, self.count, elapsed, peak_rss()))
+
+
+def peak_rss():
+    """ Returns the peak resident set size of the process (and its waited
+    children, the worker processes) in megabytes. """
+
+    # it's in kilobytes on Linux, but in bytes on OS X
+    scale = 1.0 if sys.platform == 'darwin' else 1024.0
+    usage = max(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+                resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss)
+    return usage * scale / 1e6
+
+
+def generate(bear, args, directory):
+    """ Generates the source files, the MPI compiler wrappers and the trace
+    files. Returns the trace file names and their total size. """
+
+    rng = random.Random(args.seed)
+    source_dir = os.path.join(directory, 'src')
+    trace_dir = os.path.join(directory, 'trace')
+    os.makedirs(trace_dir)
+
+    # the source files shall exist to be classified as compilation
+    modules = max(1, args.sources // 100)
+    sources = []
+    for index in range(args.sources):
+        module = os.path.join(source_dir, 'module{0}'.format(index % modules))
+        if not os.path.isdir(module):
+            os.makedirs(module)
+        name = 'file{0}.{1}'.format(index, 'c' if index % 3 else 'cpp')
+        open(os.path.join(module, name), 'w').close()
+        sources.append((module, name))
+
+    setup_mpi_wrappers(directory)
+
+    generator = records(rng, args, sources)
+    encode = functools.partial(encode_binary, bear) \
+        if args.format == 'binary' else encode_json
+    files = []
+    size = 0
+    for index in range(0, args.records, args.per_file):
+        name = os.path.join(
+            trace_dir, '{0}{1:08d}'.format(bear.TRACE_FILE_PREFIX, index))
+        with open(name, 'wb') as handle:
+            for pid, cwd, cmd in itertools.islice(generator, args.per_file):
+                handle.write(encode(pid, cwd, cmd))
+            size += handle.tell()
+        files.append(name)
+    return files, size
+
+
+def setup_mpi_wrappers(directory):
+    """ Creates fake MPI compiler wrappers, and an empty MPI wrapper cache,
+    so the classification does not depend on the host. """
+
+    bin_dir = os.path.join(directory, 'bin')
+    os.makedirs(bin_dir)
+    for wrapper, compiler in zip(MPI_WRAPPERS, ['cc', 'c++']):
+        path = os.path.join(bin_dir, wrapper)
+        with open(path, 'w') as handle:
+            handle.write('#!/bin/sh\necho {0} -I/opt/mpi/include -pthread\n'
+                         .format(compiler))
+        os.chmod(path, os.stat(path).st_mode | stat.S_IXUSR)
+    os.environ['PATH'] = os.pathsep.join([bin_dir, os.environ['PATH']])
+    os.environ['XDG_CACHE_HOME'] = os.path.join(directory, 'cache')
+
+
+def records(rng, args, sources):
+    """ Generates (pid, cwd, cmd) tuples. """
+
+    previous = []
+    for pid in itertools.count(1000):
+        draw = rng.random()
+        if draw < args.others:
+            cwd, _ = rng.choice(sources)
+            yield pid, cwd, rng.choice(OTHER_COMMANDS)
+        elif previous and rng.random() < args.duplicates:
+            cwd, cmd = rng.choice(previous)
+            yield pid, cwd, cmd
+        else:
+            cwd, cmd = compiler_call(rng, args, rng.choice(sources))
+            # keep a bounded sample of the calls to repeat
+            if len(previous) < 10000:
+                previous.append((cwd, cmd))
+            else:
+                previous[rng.randrange(len(previous))] = (cwd, cmd)
+            yield pid, cwd, cmd
+
+
+def compiler_call(rng, args, source):
+    """ Generates a compiler call with realistic flags. """
+
+    module, name = source
+    cxx = name.endswith('.cpp')
+    draw = rng.random()
+    if draw < args.mpi:
+        prefix = [MPI_WRAPPERS[1] if cxx else MPI_WRAPPERS[0]]
+    else:
+        compiler = rng.choice(COMPILERS[3:] if cxx else COMPILERS[:3])
+        prefix = [compiler]
+        if draw < args.mpi + args.wrappers:
+            prefix = [rng.choice(WRAPPERS)] + prefix
+
+    flags = ['-c', '-O2', '-g', '-fPIC', '-Wall', '-Wextra',
+             '-std=c++11' if cxx else '-std=c99']
+    length = int(rng.gauss(args.arguments, args.arguments / 4.0))
+    while len(flags) < length:
+        draw = rng.random()
+        if draw < 0.4:
+            flags.append('-I/usr/src/project/include/component{0}'
+                         .format(rng.randrange(200)))
+        elif draw < 0.7:
+            flags.append('-DCONFIG_OPTION_{0}={1}'
+                         .format(rng.randrange(500), rng.randrange(10)))
+        elif draw < 0.8:
+            flags.extend(['-isystem', '/opt/vendor/include'])
+        elif draw < 0.9:
+            flags.extend(['-MD', '-MF', name + '.d'])
+        else:
+            flags.append('-W{0}'.format(rng.choice(
+                ['shadow', 'conversion', 'format=2', 'no-unused-parameter'])))
+    obj = os.path.splitext(name)[0] + '.o'
+    return module, prefix + flags + ['-o', obj, name]
+
+
+def encode_json(pid, cwd, cmd):
+    return (json.dumps({'pid': pid, 'cmd': cmd, 'cwd': cwd}) + '\n') \
+        .encode('utf-8')
+
+
+def encode_binary(bear, pid, cwd, cmd):
+    strings = [cwd] + list(cmd)
+    payload = b''.join(value.encode('utf-8') + b'\0' for value in strings)
+    header = bear.RECORD_HEADER.pack(bear.RECORD_TAG, bear.RECORD_VERSION,
+                                     len(payload), pid, len(cmd))
+    return header + payload
+
+
+if __name__ == '__main__':
+    sys.exit(main())
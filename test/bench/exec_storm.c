@@ -0,0 +1,504 @@
+/*  Copyright (C) 2012-2017 by László Nagy
+    This file is part of Bear.
+
+    Bear is a tool to generate compilation database for clang tooling.
+
+    Bear is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bear is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Exec storm benchmark for the preload library.
+ *
+ * The driver starts worker processes (itself, with the `-w` flag), which
+ * fire the given number of exec calls of a trivial program (itself, with
+ * the `--noop` flag). Each storm runs without the preload library first,
+ * then with it, and the difference is reported per exec call.
+ *
+ * The allocations are counted by interposing the allocator functions in
+ * this executable (these are found before the preload library symbols).
+ * The counters are in a shared memory page, so the forked children are
+ * counted too (but not the programs those are executing). The system
+ * time and the page faults are taken from the resource usage of the
+ * workers.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+
+#define ENV_OUTPUT "INTERCEPT_BUILD_TARGET_DIR"
+#ifdef __APPLE__
+# define ENV_FLAT    "DYLD_FORCE_FLAT_NAMESPACE"
+# define ENV_PRELOAD "DYLD_INSERT_LIBRARIES"
+#else
+# define ENV_PRELOAD "LD_PRELOAD"
+#endif
+
+// ..:: environment access fixer - begin ::..
+#ifdef HAVE_NSGETENVIRON
+#include <crt_externs.h>
+#else
+extern char **environ;
+#endif
+
+char **get_environ() {
+#ifdef HAVE_NSGETENVIRON
+    return *_NSGetEnviron();
+#else
+    return environ;
+#endif
+}
+// ..:: environment access fixer - end ::..
+
+// ..:: allocation counter - begin ::..
+typedef struct {
+    long allocations;
+} counters_t;
+
+static counters_t *counters = NULL;
+
+#ifdef HAVE_LIBC_MALLOC
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static void count_allocation() {
+    if (counters)
+        __sync_fetch_and_add(&counters->allocations, 1);
+}
+
+void *malloc(size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+#endif
+
+static void counters_open() {
+    void *page = mmap(NULL, sizeof(counters_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == page) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    counters = (counters_t *)page;
+}
+// ..:: allocation counter - end ::..
+
+// ..:: exec storm - begin ::..
+typedef void (*exec_fun)(char const *program);
+
+static char *const *noop_argv(char const *program) {
+    static char *argv[3];
+    argv[0] = (char *)program;
+    argv[1] = "--noop";
+    argv[2] = 0;
+    return argv;
+}
+
+static void wait_for(pid_t child) {
+    int status;
+    if (-1 == waitpid(child, &status, 0)) {
+        perror("wait");
+        exit(EXIT_FAILURE);
+    }
+    if (WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE) {
+        fprintf(stderr, "children process has non zero exit code\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+#define FORK(FUNC)                                                             \
+    {                                                                          \
+        pid_t child = fork();                                                  \
+        if (-1 == child) {                                                     \
+            perror("fork");                                                    \
+            exit(EXIT_FAILURE);                                                \
+        } else if (0 == child) {                                               \
+            FUNC fprintf(stderr, "children process failed to exec\n");         \
+            _exit(EXIT_FAILURE);                                               \
+        } else {                                                               \
+            wait_for(child);                                                   \
+        }                                                                      \
+    }
+
+#ifdef HAVE_EXECVE
+static void call_execve(char const *program) {
+    FORK(execve(program, noop_argv(program), get_environ());)
+}
+#endif
+
+#ifdef HAVE_EXECVP
+static void call_execvp(char const *program) {
+    FORK(execvp(program, noop_argv(program));)
+}
+#endif
+
+#ifdef HAVE_POSIX_SPAWN
+static void call_posix_spawn(char const *program) {
+    pid_t child;
+    if (0 != posix_spawn(&child, program, 0, 0, noop_argv(program), get_environ())) {
+        perror("posix_spawn");
+        exit(EXIT_FAILURE);
+    }
+    wait_for(child);
+}
+#endif
+
+typedef struct {
+    char const *name;
+    exec_fun call;
+} method_t;
+
+static method_t const methods[] = {
+#ifdef HAVE_EXECVE
+    { "execve", call_execve },
+#endif
+#ifdef HAVE_EXECVP
+    { "execvp", call_execvp },
+#endif
+#ifdef HAVE_POSIX_SPAWN
+    { "posix_spawn", call_posix_spawn },
+#endif
+    { 0, 0 }
+};
+
+static method_t const *find_method(char const *name) {
+    for (method_t const *it = methods; it->name; ++it) {
+        if (0 == strcmp(it->name, name))
+            return it;
+    }
+    fprintf(stderr, "unknown method: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Runs the storm in the given number of parallel processes, and prints
+ * the elapsed time and the allocation count to the standard output. */
+static int run_worker(char const *program, method_t const *method, long count, long jobs) {
+    counters_open();
+
+    long const start = now_ns();
+    for (long job = 0; job < jobs; ++job) {
+        pid_t child = fork();
+        if (-1 == child) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (0 == child) {
+            for (long it = job; it < count; it += jobs)
+                method->call(program);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    for (long job = 0; job < jobs; ++job) {
+        int status;
+        if (-1 == wait(&status) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "storm process failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    long const elapsed = now_ns() - start;
+
+    printf("%ld %ld\n", elapsed, counters->allocations);
+    return EXIT_SUCCESS;
+}
+// ..:: exec storm - end ::..
+
+// ..:: driver - begin ::..
+typedef struct {
+    long elapsed_ns;
+    long allocations;
+    long system_us;
+    long page_faults;
+    long traces;
+} sample_t;
+
+/* Copies the environment without the preload related variables, and adds
+ * those back when the library is given. */
+static char **worker_environment(char const *library, char const *out_dir) {
+    char **const envp = get_environ();
+    size_t size = 0;
+    while (envp[size])
+        ++size;
+
+    char **result = calloc(size + 4, sizeof(char *));
+    size_t it = 0;
+    for (char **entry = envp; *entry; ++entry) {
+        if (0 == strncmp(*entry, ENV_PRELOAD "=", strlen(ENV_PRELOAD) + 1) ||
+#ifdef ENV_FLAT
+            0 == strncmp(*entry, ENV_FLAT "=", strlen(ENV_FLAT) + 1) ||
+#endif
+            0 == strncmp(*entry, ENV_OUTPUT "=", strlen(ENV_OUTPUT) + 1))
+            continue;
+        result[it++] = *entry;
+    }
+    if (library) {
+        static char preload[PATH_MAX + 32];
+        static char output[PATH_MAX + 32];
+        snprintf(preload, sizeof(preload), "%s=%s", ENV_PRELOAD, library);
+        snprintf(output, sizeof(output), "%s=%s", ENV_OUTPUT, out_dir);
+        result[it++] = preload;
+        result[it++] = output;
+#ifdef ENV_FLAT
+        result[it++] = ENV_FLAT "=1";
+#endif
+    }
+    result[it] = 0;
+    return result;
+}
+
+/* Counts and removes the trace files. */
+static long clean_traces(char const *out_dir) {
+    long count = 0;
+    DIR *dir = opendir(out_dir);
+    if (!dir) {
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        if ('.' == entry->d_name[0])
+            continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", out_dir, entry->d_name);
+        if (-1 == unlink(path)) {
+            perror("unlink");
+            exit(EXIT_FAILURE);
+        }
+        ++count;
+    }
+    closedir(dir);
+    return count;
+}
+
+static sample_t run_sample(char const *program, char const *method, long count, long jobs,
+                           char const *library, char const *out_dir) {
+    char count_arg[32];
+    char jobs_arg[32];
+    snprintf(count_arg, sizeof(count_arg), "%ld", count);
+    snprintf(jobs_arg, sizeof(jobs_arg), "%ld", jobs);
+    char *const argv[] = {
+        (char *)program, "-w", (char *)method, "-n", count_arg, "-j", jobs_arg, 0
+    };
+    char **const envp = worker_environment(library, out_dir);
+
+    int fds[2];
+    if (-1 == pipe(fds)) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t child = fork();
+    if (-1 == child) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (0 == child) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execve(program, argv, envp);
+        perror("execve");
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+    free(envp);
+
+    sample_t result;
+    memset(&result, 0, sizeof(result));
+    FILE *input = fdopen(fds[0], "r");
+    if (!input || 2 != fscanf(input, "%ld %ld", &result.elapsed_ns, &result.allocations)) {
+        fprintf(stderr, "worker did not report\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(input);
+
+    int status;
+    struct rusage usage;
+    if (-1 == wait4(child, &status, 0, &usage)) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "worker process failed\n");
+        exit(EXIT_FAILURE);
+    }
+    result.system_us = usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec;
+    result.page_faults = usage.ru_minflt + usage.ru_majflt;
+    result.traces = clean_traces(out_dir);
+    return result;
+}
+
+/* Runs the sample repeatedly, and keeps the fastest one. */
+static sample_t run_best(char const *program, char const *method, long count, long jobs,
+                         long repeat, char const *library, char const *out_dir) {
+    sample_t best = run_sample(program, method, count, jobs, library, out_dir);
+    for (long it = 1; it < repeat; ++it) {
+        sample_t const current = run_sample(program, method, count, jobs, library, out_dir);
+        if (current.elapsed_ns < best.elapsed_ns)
+            best = current;
+    }
+    return best;
+}
+
+static void report(char const *method, long count, long jobs, sample_t const *plain, sample_t const *ear) {
+    double const plain_us = plain->elapsed_ns / 1000.0 / count;
+    double const ear_us = ear->elapsed_ns / 1000.0 / count;
+    printf("%-12s %4ld %7ld %10.1f %10.1f %10.1f %7.1f%% ",
+           method, jobs, count, plain_us, ear_us, ear_us - plain_us,
+           100.0 * (ear_us - plain_us) / plain_us);
+#ifdef HAVE_LIBC_MALLOC
+    printf("%8.1f ", (double)(ear->allocations - plain->allocations) / count);
+#else
+    printf("%8s ", "n/a");
+#endif
+    printf("%8.1f %8.1f %7ld\n",
+           (double)(ear->system_us - plain->system_us) / count,
+           (double)(ear->page_faults - plain->page_faults) / count,
+           ear->traces);
+}
+
+static void usage(char const *name) {
+    fprintf(stderr,
+            "usage: %s -l <library> [-n <execs>] [-j <jobs>] [-r <repeat>] [-m <method>]\n",
+            name);
+}
+
+int main(int argc, char *const argv[]) {
+    if (2 == argc && 0 == strcmp(argv[1], "--noop"))
+        return 0;
+
+    char const *library = NULL;
+    char const *method = NULL;
+    char const *worker = NULL;
+    long count = 1000;
+    long jobs = 4;
+    long repeat = 3;
+    int c = 0;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "l:m:w:n:j:r:")) != -1) {
+        switch (c) {
+            case 'l':
+                library = optarg;
+                break;
+            case 'm':
+                method = optarg;
+                break;
+            case 'w':
+                worker = optarg;
+                break;
+            case 'n':
+                count = strtol(optarg, NULL, 10);
+                break;
+            case 'j':
+                jobs = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                repeat = strtol(optarg, NULL, 10);
+                break;
+            case '?':
+                if (isprint(optopt))
+                    fprintf(stderr, "Unknown option or missing argument `-%c'.\n", optopt);
+                else
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                usage(argv[0]);
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (count < 1 || jobs < 1 || repeat < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char *const program = realpath(argv[0], NULL);
+    if (!program) {
+        perror("realpath");
+        return 1;
+    }
+    if (worker)
+        return run_worker(program, find_method(worker), count, jobs);
+
+    if (!library) {
+        usage(argv[0]);
+        return 1;
+    }
+    char *const library_path = realpath(library, NULL);
+    if (!library_path) {
+        perror("realpath");
+        return 1;
+    }
+    char template[] = "/tmp/exec-storm-XXXXXX";
+    char const *const out_dir = mkdtemp(template);
+    if (!out_dir) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    printf("%-12s %4s %7s %10s %10s %10s %8s %8s %8s %8s %7s\n",
+           "method", "jobs", "execs", "plain us", "ear us", "+us/exec", "+%",
+           "+allocs", "+sys us", "+faults", "traces");
+    for (method_t const *it = methods; it->name; ++it) {
+        if (method && 0 != strcmp(method, it->name))
+            continue;
+        // serially first, then in parallel
+        long const parallels[] = { 1, jobs };
+        for (size_t idx = 0; idx < ((jobs > 1) ? 2 : 1); ++idx) {
+            long const parallel = parallels[idx];
+            sample_t const plain = run_best(program, it->name, count, parallel, repeat, NULL, out_dir);
+            sample_t const ear = run_best(program, it->name, count, parallel, repeat, library_path, out_dir);
+            report(it->name, count, parallel, &plain, &ear);
+        }
+    }
+
+    rmdir(out_dir);
+    free(library_path);
+    free(program);
+    return 0;
+}
+// ..:: driver - end ::..